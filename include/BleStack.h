@@ -0,0 +1,312 @@
+// Thin layer over the two BLE host stacks the firmwares can be built with.
+//
+// The default build uses the Bluedroid-based BLE library that ships with the
+// Arduino core. Building with -D USE_NIMBLE (see the *-NimBLE environments in
+// platformio.ini) switches to NimBLE-Arduino instead. The Arduino classes of
+// both stacks share most of their API, so the sources use the Ble* aliases
+// below and only call the ble* helpers where the two stacks differ.
+#ifndef BLE_STACK_H
+#define BLE_STACK_H
+
+#include <Arduino.h>
+#include <string>
+#include <vector>
+
+#ifdef USE_NIMBLE
+
+#include <NimBLEDevice.h>
+
+#define BLE_STACK_NAME "NimBLE"
+#define BLE_MAX_CONNECTIONS CONFIG_BT_NIMBLE_MAX_CONNECTIONS
+
+typedef NimBLEDevice BleDevice;
+typedef NimBLEAddress BleAddress;
+typedef NimBLEUUID BleUUID;
+typedef NimBLEScan BleScan;
+typedef NimBLEScanResults BleScanResults;
+typedef NimBLEAdvertisedDevice BleAdvertisedDevice;
+typedef NimBLEAdvertisedDeviceCallbacks BleAdvertisedDeviceCallbacks;
+typedef NimBLEAdvertising BleAdvertising;
+typedef NimBLEClient BleClient;
+typedef NimBLEClientCallbacks BleClientCallbacks;
+typedef NimBLERemoteService BleRemoteService;
+typedef NimBLERemoteCharacteristic BleRemoteCharacteristic;
+typedef NimBLEServer BleServer;
+typedef NimBLEServerCallbacks BleServerCallbacks;
+typedef NimBLEService BleService;
+typedef NimBLECharacteristic BleCharacteristic;
+typedef NimBLECharacteristicCallbacks BleCharacteristicCallbacks;
+
+#define BLE_PHY_1M BLE_GAP_LE_PHY_1M_MASK
+#define BLE_PHY_2M BLE_GAP_LE_PHY_2M_MASK
+
+#define BLE_PROPERTY_READ   NIMBLE_PROPERTY::READ
+#define BLE_PROPERTY_WRITE  NIMBLE_PROPERTY::WRITE
+#define BLE_PROPERTY_NOTIFY NIMBLE_PROPERTY::NOTIFY
+
+#else
+
+#include <BLEDevice.h>
+#include <BLEUtils.h>
+#include <BLEServer.h>
+#include <BLEClient.h>
+#include <BLE2902.h>
+
+#define BLE_STACK_NAME "Bluedroid"
+#define BLE_MAX_CONNECTIONS CONFIG_BT_ACL_CONNECTIONS
+
+typedef BLEDevice BleDevice;
+typedef BLEAddress BleAddress;
+typedef BLEUUID BleUUID;
+typedef BLEScan BleScan;
+typedef BLEScanResults BleScanResults;
+typedef BLEAdvertisedDevice BleAdvertisedDevice;
+typedef BLEAdvertisedDeviceCallbacks BleAdvertisedDeviceCallbacks;
+typedef BLEAdvertising BleAdvertising;
+typedef BLEClient BleClient;
+typedef BLEClientCallbacks BleClientCallbacks;
+typedef BLERemoteService BleRemoteService;
+typedef BLERemoteCharacteristic BleRemoteCharacteristic;
+typedef BLEServer BleServer;
+typedef BLEServerCallbacks BleServerCallbacks;
+typedef BLEService BleService;
+typedef BLECharacteristic BleCharacteristic;
+typedef BLECharacteristicCallbacks BleCharacteristicCallbacks;
+
+#define BLE_PHY_1M ESP_BLE_GAP_PHY_1M_PREF_MASK
+#define BLE_PHY_2M ESP_BLE_GAP_PHY_2M_PREF_MASK
+
+#define BLE_PROPERTY_READ   BLECharacteristic::PROPERTY_READ
+#define BLE_PROPERTY_WRITE  BLECharacteristic::PROPERTY_WRITE
+#define BLE_PROPERTY_NOTIFY BLECharacteristic::PROPERTY_NOTIFY
+
+// Bluedroid addresses a single connection through the GATT server interface,
+// which the Arduino classes do not expose, so it is captured at registration.
+inline esp_gatt_if_t& bleGattsIf() {
+  static esp_gatt_if_t gattsIf = ESP_GATT_IF_NONE;
+  return gattsIf;
+}
+
+// Defined with the server helpers below.
+inline void bleGattsEventHandler(esp_gatts_cb_event_t event, esp_gatt_if_t gatts_if, esp_ble_gatts_cb_param_t *param);
+
+#endif
+
+typedef void (*BleNotifyCallback)(BleRemoteCharacteristic*, uint8_t*, size_t, bool);
+
+//-------------------------//
+// Device                  //
+//-------------------------//
+
+inline void bleInit(const char* name) {
+#ifndef USE_NIMBLE
+  BleDevice::setCustomGattsHandler(bleGattsEventHandler);
+#endif
+  BleDevice::init(name);
+}
+
+//-------------------------//
+// Client                  //
+//-------------------------//
+
+// Connect and negotiate the ATT MTU. NimBLE exchanges its preferred MTU while
+// connecting, Bluedroid needs an explicit request once the link is up.
+template <typename Target>
+bool bleConnect(BleClient* client, Target target, uint16_t mtu) {
+#ifdef USE_NIMBLE
+  BleDevice::setMTU(mtu);
+  return client->connect(target);
+#else
+  if (!client->connect(target)) return false;
+  client->setMTU(mtu);
+  return true;
+#endif
+}
+
+// Drop the link and free the client. Bluedroid tears the client down from
+// its disconnect event, so wait for that before deleting it.
+inline void bleDeleteClient(BleClient* client) {
+#ifdef USE_NIMBLE
+  BleDevice::deleteClient(client);
+#else
+  if (client->isConnected()) {
+    client->disconnect();
+    for (int i = 0; i < 100 && client->isConnected(); i++) vTaskDelay(pdMS_TO_TICKS(10));
+    vTaskDelay(pdMS_TO_TICKS(50));
+  }
+  delete client;
+#endif
+}
+
+// Ask the peer for a new connection interval; intervals in 1.25 ms units,
+// supervision timeout in 10 ms units.
+inline bool bleUpdateConnParams(BleClient* client, uint16_t minInterval, uint16_t maxInterval, uint16_t latency, uint16_t timeout) {
+#ifdef USE_NIMBLE
+  client->updateConnParams(minInterval, maxInterval, latency, timeout);
+  return true;
+#else
+  esp_ble_conn_update_params_t params;
+  memcpy(params.bda, *client->getPeerAddress().getNative(), sizeof(esp_bd_addr_t));
+  params.min_int = minInterval;
+  params.max_int = maxInterval;
+  params.latency = latency;
+  params.timeout = timeout;
+  return esp_ble_gap_update_conn_params(&params) == ESP_OK;
+#endif
+}
+
+// Prefer the given PHYs (BLE_PHY_* mask) in both directions on this link.
+inline bool bleSetPhy(BleClient* client, uint8_t phyMask) {
+#ifdef USE_NIMBLE
+  return ble_gap_set_prefered_le_phy(client->getConnId(), phyMask, phyMask, BLE_GAP_LE_PHY_CODED_ANY) == 0;
+#elif CONFIG_BT_BLE_50_FEATURES_SUPPORTED
+  return esp_ble_gap_set_preferred_phy(*client->getPeerAddress().getNative(), 0, phyMask, phyMask, ESP_BLE_GAP_PHY_OPTIONS_NO_PREF) == ESP_OK;
+#else
+  return false;
+#endif
+}
+
+inline std::vector<BleRemoteService*> bleGetServices(BleClient* client) {
+  std::vector<BleRemoteService*> services;
+#ifdef USE_NIMBLE
+  auto servicesList = client->getServices(true);
+  if (servicesList != nullptr) services = *servicesList;
+#else
+  auto servicesMap = client->getServices();
+  if (servicesMap != nullptr) {
+    for (auto const& servicePair : *servicesMap) services.push_back(servicePair.second);
+  }
+#endif
+  return services;
+}
+
+inline std::vector<BleRemoteCharacteristic*> bleGetCharacteristics(BleRemoteService* service) {
+  std::vector<BleRemoteCharacteristic*> characteristics;
+#ifdef USE_NIMBLE
+  auto characteristicsList = service->getCharacteristics(true);
+  if (characteristicsList != nullptr) characteristics = *characteristicsList;
+#else
+  auto characteristicsMap = service->getCharacteristics();
+  if (characteristicsMap != nullptr) {
+    for (auto const& charPair : *characteristicsMap) characteristics.push_back(charPair.second);
+  }
+#endif
+  return characteristics;
+}
+
+inline std::string bleReadValue(BleRemoteCharacteristic* characteristic) {
+  return characteristic->readValue();
+}
+
+inline void bleWriteValue(BleRemoteCharacteristic* characteristic, const uint8_t* data, size_t length, bool response) {
+  characteristic->writeValue((uint8_t*)data, length, response);
+}
+
+// Subscribe to notifications, or unsubscribe when callback is nullptr.
+inline bool bleSubscribe(BleRemoteCharacteristic* characteristic, BleNotifyCallback callback) {
+#ifdef USE_NIMBLE
+  return callback != nullptr ? characteristic->subscribe(true, callback) : characteristic->unsubscribe();
+#else
+  characteristic->registerForNotify(callback);
+  return true;
+#endif
+}
+
+// Scan results are passed by value on Bluedroid and by pointer on NimBLE.
+class BleScanEvents : public BleAdvertisedDeviceCallbacks {
+public:
+  virtual void onDevice(BleAdvertisedDevice& device) = 0;
+#ifdef USE_NIMBLE
+  void onResult(NimBLEAdvertisedDevice* device) override { onDevice(*device); }
+#else
+  void onResult(BLEAdvertisedDevice device) override { onDevice(device); }
+#endif
+};
+
+//-------------------------//
+// Server                  //
+//-------------------------//
+
+// Client Characteristic Configuration Descriptor; NimBLE adds it on its own.
+inline void bleAddNotifyDescriptor(BleCharacteristic* characteristic) {
+#ifndef USE_NIMBLE
+  characteristic->addDescriptor(new BLE2902());
+#endif
+}
+
+// Send a notification to one connection rather than to every subscriber.
+inline bool bleNotifyConnection(BleCharacteristic* characteristic, uint16_t connId, const uint8_t* data, size_t length) {
+#ifdef USE_NIMBLE
+  struct os_mbuf* om = ble_hs_mbuf_from_flat(data, length);
+  return om != nullptr && ble_gattc_notify_custom(connId, characteristic->getHandle(), om) == 0;
+#else
+  return esp_ble_gatts_send_indicate(bleGattsIf(), connId, characteristic->getHandle(), length, (uint8_t*)data, false) == ESP_OK;
+#endif
+}
+
+// Connection events carrying the connection id on either stack.
+class BleServerEvents : public BleServerCallbacks {
+public:
+  virtual void onPeerConnect(BleServer* server, uint16_t connId) {}
+  virtual void onPeerDisconnect(BleServer* server, uint16_t connId) {}
+#ifdef USE_NIMBLE
+  void onConnect(NimBLEServer* server, ble_gap_conn_desc* desc) override { onPeerConnect(server, desc->conn_handle); }
+  void onDisconnect(NimBLEServer* server, ble_gap_conn_desc* desc) override { onPeerDisconnect(server, desc->conn_handle); }
+#else
+  void onConnect(BLEServer* server, esp_ble_gatts_cb_param_t* param) override { onPeerConnect(server, param->connect.conn_id); }
+  void onDisconnect(BLEServer* server, esp_ble_gatts_cb_param_t* param) override { onPeerDisconnect(server, param->disconnect.conn_id); }
+#endif
+};
+
+// Write and subscription events carrying the id of the connection on either
+// stack. subscribed follows the notify bit that connection wrote to the CCCD.
+class BleWriteEvents : public BleCharacteristicCallbacks {
+public:
+  virtual void onPeerWrite(BleCharacteristic* characteristic, uint16_t connId) = 0;
+  virtual void onPeerSubscribe(BleCharacteristic* characteristic, uint16_t connId, bool subscribed) {}
+#ifdef USE_NIMBLE
+  void onWrite(NimBLECharacteristic* characteristic, ble_gap_conn_desc* desc) override { onPeerWrite(characteristic, desc->conn_handle); }
+  void onSubscribe(NimBLECharacteristic* characteristic, ble_gap_conn_desc* desc, uint16_t subValue) override {
+    onPeerSubscribe(characteristic, desc->conn_handle, subValue & 0x0001);
+  }
+#else
+  void onWrite(BLECharacteristic* characteristic, esp_ble_gatts_cb_param_t* param) override { onPeerWrite(characteristic, param->write.conn_id); }
+#endif
+};
+
+#ifndef USE_NIMBLE
+// BLE2902 keeps one value for all connections and its callbacks carry no
+// connection id, so CCCD writes are picked up in the GATTS handler instead.
+struct BleSubscriptionWatch {
+  BLEDescriptor* cccd;
+  BLECharacteristic* characteristic;
+  BleWriteEvents* events;
+};
+
+inline std::vector<BleSubscriptionWatch>& bleSubscriptionWatches() {
+  static std::vector<BleSubscriptionWatch> watches;
+  return watches;
+}
+
+inline void bleGattsEventHandler(esp_gatts_cb_event_t event, esp_gatt_if_t gatts_if, esp_ble_gatts_cb_param_t *param) {
+  if (event == ESP_GATTS_REG_EVT) {
+    bleGattsIf() = gatts_if;
+  } else if (event == ESP_GATTS_WRITE_EVT && !param->write.is_prep && param->write.len >= 2) {
+    for (auto const& watch : bleSubscriptionWatches()) {
+      if (watch.cccd->getHandle() != param->write.handle) continue;
+      watch.events->onPeerSubscribe(watch.characteristic, param->write.conn_id, param->write.value[0] & 0x01);
+    }
+  }
+}
+#endif
+
+// Attach write and subscription events. Call after bleAddNotifyDescriptor().
+inline void bleSetWriteEvents(BleCharacteristic* characteristic, BleWriteEvents* events) {
+  characteristic->setCallbacks(events);
+#ifndef USE_NIMBLE
+  BLEDescriptor* cccd = characteristic->getDescriptorByUUID(BLEUUID((uint16_t)0x2902));
+  if (cccd != nullptr) bleSubscriptionWatches().push_back({cccd, characteristic, events});
+#endif
+}
+
+#endif
@@ -1,9 +1,8 @@
 #include <Arduino.h>
-#include <BLEDevice.h>
-#include <BLEUtils.h>
-#include <BLEServer.h>
-#include <BLEClient.h>
-#include <BLE2902.h>
+#include "BleStack.h"
+#include <esp_timer.h>
+#include <esp_heap_caps.h>
+#include <Preferences.h>
 #include <map>
 
 // Server mode default UUIDs (for example)
@@ -14,63 +13,742 @@
 //-------------------------//
 // Global Server Variables //
 //-------------------------//
-BLEServer* pServer = nullptr;
-BLEService* pService = nullptr;
-BLECharacteristic* pCharacteristic = nullptr;
+BleServer* pServer = nullptr;
+BleService* pService = nullptr;
+BleCharacteristic* pCharacteristic = nullptr;
 bool bleInitialized = false;
 bool bleAdvertising = false;
 
 String clientName = "";
 
+//-------------------------//
+// Performance Counters    //
+//-------------------------//
+
+// Min/mean/max accumulator. Samples are raw CPU cycles so recording is a
+// handful of instructions; conversion to microseconds happens in AT+PERF?.
+struct PerfStat {
+  uint32_t count;
+  uint32_t min;
+  uint32_t max;
+  uint64_t total;
+};
+
+inline void perfRecord(PerfStat& stat, uint32_t cycles) {
+  if (stat.count == 0 || cycles < stat.min) stat.min = cycles;
+  if (cycles > stat.max) stat.max = cycles;
+  stat.total += cycles;
+  stat.count++;
+}
+
+PerfStat perfNotify;                  // notifyCallback duration
+PerfStat perfConnect;                 // connect and MTU exchange, in microseconds
+PerfStat perfUartWrite;               // time spent inside Serial.write on the hot path
+std::map<String, PerfStat> perfCommands;  // processATCommand latency per command, in microseconds
+uint32_t perfUartBytes = 0;           // bytes handed to the UART
+uint32_t perfUartStalls = 0;          // writes that did not fit in the TX FIFO
+uint32_t perfUartStalledBytes = 0;    // bytes that had to wait for TX room
+int perfUartTxCapacity = 0;           // TX room when idle, sampled at boot
+int perfUartTxHighWater = 0;          // most bytes seen pending in TX
+int64_t perfResetTime = 0;            // esp_timer time of the last reset
+
 //-------------------------//
 // Multi-Client Structures //
 //-------------------------//
 
+// Characteristics a single client can subscribe to at once
+#define MAX_STREAMS_PER_CLIENT 4
+
+struct BLEClientConnection;
+
+// One read/notify characteristic of a client, reported as <clientId>:<streamId>
+struct NotifyStream {
+  BLEClientConnection* connection;
+  int streamId;
+  String characteristicUUID;
+  BleRemoteCharacteristic* remoteCharacteristicPtr;
+  bool subscribed;
+  // Notifications delivered since the last AT+PERFRESET
+  uint32_t notifyCount;
+  // Inter-arrival gaps in microseconds
+  int64_t lastArrival;
+  PerfStat gap;
+  // Firmware polling (AT+BLEPOLL), 0 when off
+  uint32_t pollIntervalMs;
+  uint32_t pollPeriodMs;  // current period after backoff
+  uint32_t pollReads;
+  uint32_t pollFailures;
+  int64_t pollDue;        // esp_timer time of the next read
+};
+
+// MTU requested on connect unless AT+BLECONNECT gives one
+#define DEFAULT_MTU 128
+
 struct BLEClientConnection {
-  BLEClient* client;
+  int clientId;
+  BleClient* client;
   String deviceAddress;
+  // Link settings, kept so they can be saved in the boot profile
+  uint16_t mtu;
+  uint16_t connIntervalMin;  // 1.25 ms units, 0 when left to the stack
+  uint16_t connIntervalMax;
   // Cached pointers for reading
   String serviceUUID;
-  String characteristicUUID;
-  BLERemoteService* remoteServicePtr;
-  BLERemoteCharacteristic* remoteCharacteristicPtr;
+  BleRemoteService* remoteServicePtr;
+  NotifyStream streams[MAX_STREAMS_PER_CLIENT];
   // Cached pointers for writing
   String writeServiceUUID;
   String writeCharacteristicUUID;
-  BLERemoteService* remoteWriteServicePtr;
-  BLERemoteCharacteristic* remoteWriteCharacteristicPtr;
+  BleRemoteService* remoteWriteServicePtr;
+  BleRemoteCharacteristic* remoteWriteCharacteristicPtr;
+  // Held around reads so AT+BLEREAD and the poll task take turns on the link
+  SemaphoreHandle_t readMutex;
+  // Index into outputQueues, 0 until registered
+  int outputQueue;
+  // Output drops, reported in-band as +DROP:<clientId>,<new>,<total>; client 0 is unmapped
+  uint32_t dropped;
+  uint32_t droppedReported;
+  uint32_t decimateCounter;
 };
 
 std::map<int, BLEClientConnection*> clientConnections;
 int nextClientId = 1;
 
-// Map to associate a remote characteristic with a client ID for notifications
-std::map<BLERemoteCharacteristic*, int> notifyMap;
+// Map to associate a remote characteristic with its stream for notifications
+std::map<BleRemoteCharacteristic*, NotifyStream*> notifyMap;
+
+//-------------------------//
+// Output Queue            //
+//-------------------------//
+
+// Largest attribute value the ATT protocol allows
+#define MAX_NOTIFY_LENGTH 512
+// Notifications buffered between the BLE task and the UART
+#define OUTPUT_POOL_SLOTS 96
+// Records written per loop() pass, so commands are still served under load
+#define OUTPUT_DRAIN_BATCH 16
+#define UART_TX_BUFFER_SIZE 4096
+// Queue 0 takes unmapped notifications and clients registered past the limit
+#define MAX_OUTPUT_QUEUES 16
+// Payload bytes a queue may send per round for each unit of weight
+#define OUTPUT_QUANTUM 128
+#define MAX_OUTPUT_WEIGHT 16
+
+// What to discard once the queue is full, or while the host has no credits
+enum DropPolicy {
+  DROP_OLDEST,   // Evict the oldest queued notification
+  DROP_NEWEST,   // Discard the notification that just arrived
+  DECIMATE       // Keep one in every outputDecimation per client, then drop newest
+};
+
+struct OutputRecord {
+  int64_t timestamp;  // esp_timer time of arrival
+  BLEClientConnection* connection;  // nullptr for an unmapped characteristic
+  int clientId;
+  uint8_t streamId;
+  uint8_t queue;
+  uint16_t length;
+  uint8_t data[MAX_NOTIFY_LENGTH];
+};
+
+// FIFO of pool indices for one client, drained by deficit round robin
+struct OutputQueue {
+  uint8_t ring[OUTPUT_POOL_SLOTS];
+  int head;
+  int count;
+  int highWater;
+  int weight;
+  int deficit;
+  PerfStat delay;  // arrival to UART, in microseconds
+};
+
+// Records live in a fixed pool shared by all queues.
+OutputRecord* outputPool = nullptr;
+uint8_t outputFree[OUTPUT_POOL_SLOTS];
+int outputFreeCount = 0;
+OutputQueue outputQueues[MAX_OUTPUT_QUEUES];
+int outputQueueCount = 0;
+int outputTurn = 0;          // queue the scheduler is serving
+bool outputTurnStarted = false;
+int outputCount = 0;
+int outputHighWater = 0;
+uint32_t outputDropped = 0;
+// Drops with no client to charge (unmapped notifications), reported as client 0
+uint32_t unmappedDropped = 0;
+uint32_t unmappedDroppedReported = 0;
+portMUX_TYPE outputLock = portMUX_INITIALIZER_UNLOCKED;
+
+// Host flow control: with AT+FLOW=1 every line written costs one credit
+// granted by AT+CREDIT; XOFF/XON bytes on the input pause and resume output.
+bool flowControl = false;
+int32_t outputCredits = 0;
+bool outputPaused = false;
+DropPolicy dropPolicy = DROP_NEWEST;
+int outputDecimation = 4;
+
+// Merge mode (AT+MERGE=1): output follows arrival time across all clients
+// instead of the fair schedule, and lines carry their arrival timestamp.
+// Records are stamped when the value arrives, before outputLock is taken, so
+// one can reach the queues after a later one. Each record is held until it is
+// mergeHoldUs old, giving late records time to slot in ahead of it.
+#define MAX_MERGE_HOLD_MS 1000
+bool mergeOutput = false;
+int64_t mergeHoldUs = 20000;
+
+bool initOutputQueue() {
+  outputPool = (OutputRecord*)heap_caps_malloc(sizeof(OutputRecord) * OUTPUT_POOL_SLOTS, MALLOC_CAP_8BIT);
+  if (outputPool == nullptr) return false;
+  for (int i = 0; i < OUTPUT_POOL_SLOTS; i++) {
+    outputFree[i] = i;
+  }
+  outputFreeCount = OUTPUT_POOL_SLOTS;
+  memset(outputQueues, 0, sizeof(outputQueues));
+  outputQueues[0].weight = 1;
+  outputQueueCount = 1;
+  return true;
+}
+
+// Give a newly registered client its own queue; falls back to the shared one.
+int assignOutputQueue() {
+  if (outputQueueCount == MAX_OUTPUT_QUEUES) return 0;
+  int index = outputQueueCount;
+  memset(&outputQueues[index], 0, sizeof(OutputQueue));
+  outputQueues[index].weight = 1;
+  portENTER_CRITICAL(&outputLock);
+  outputQueueCount++;
+  portEXIT_CRITICAL(&outputLock);
+  return index;
+}
+
+// Ring helpers; callers hold outputLock.
+inline uint8_t popOutputHead(OutputQueue& queue) {
+  uint8_t slot = queue.ring[queue.head];
+  queue.head = (queue.head + 1) % OUTPUT_POOL_SLOTS;
+  queue.count--;
+  outputCount--;
+  return slot;
+}
+
+inline uint8_t popOutputTail(OutputQueue& queue) {
+  queue.count--;
+  outputCount--;
+  return queue.ring[(queue.head + queue.count) % OUTPUT_POOL_SLOTS];
+}
+
+bool outputBlocked() {
+  return outputPaused || (flowControl && outputCredits <= 0);
+}
+
+// Charge one dropped notification to its client. Caller holds outputLock.
+inline void countDrop(BLEClientConnection* connection) {
+  if (connection != nullptr) {
+    connection->dropped++;
+  } else {
+    unmappedDropped++;
+  }
+  outputDropped++;
+}
+
+// Queue one notification stamped with its arrival time. Runs on the BLE and
+// poll tasks; the lock is held only for bookkeeping and the copy. Each queue
+// is kept in arrival order for merge mode. When the pool is full the
+// room is taken from the longest queue, so a fast client cannot crowd out the
+// slower ones.
+void enqueueOutput(BLEClientConnection* connection, int clientId, int streamId,
+                   int64_t timestamp, const uint8_t* data, size_t length) {
+  if (outputPool == nullptr) return;
+  if (length > MAX_NOTIFY_LENGTH) length = MAX_NOTIFY_LENGTH;
+  int queueIndex = connection != nullptr ? connection->outputQueue : 0;
+  OutputQueue& queue = outputQueues[queueIndex];
+  portENTER_CRITICAL(&outputLock);
+  bool blocked = outputBlocked();
+  if (dropPolicy == DECIMATE && blocked && connection != nullptr &&
+      connection->decimateCounter++ % outputDecimation != 0) {
+    countDrop(connection);
+    portEXIT_CRITICAL(&outputLock);
+    return;
+  }
+  if (outputFreeCount == 0) {
+    OutputQueue* longest = &queue;
+    for (int i = 0; i < outputQueueCount; i++) {
+      if (outputQueues[i].count > longest->count) longest = &outputQueues[i];
+    }
+    int victim = -1;
+    if (dropPolicy == DROP_OLDEST && longest->count > 0) {
+      victim = popOutputHead(*longest);
+    } else if (longest != &queue) {
+      victim = popOutputTail(*longest);
+    }
+    if (victim == -1) {
+      countDrop(connection);
+      portEXIT_CRITICAL(&outputLock);
+      return;
+    }
+    outputFree[outputFreeCount++] = victim;
+    countDrop(outputPool[victim].connection);
+  }
+  uint8_t slot = outputFree[--outputFreeCount];
+  OutputRecord& record = outputPool[slot];
+  record.timestamp = timestamp;
+  record.connection = connection;
+  record.clientId = clientId;
+  record.streamId = streamId;
+  record.queue = queueIndex;
+  record.length = length;
+  memcpy(record.data, data, length);
+  // Usually lands at the tail; a record that lost the race for the lock
+  // moves back past the later ones
+  int pos = queue.count;
+  while (pos > 0) {
+    uint8_t previous = queue.ring[(queue.head + pos - 1) % OUTPUT_POOL_SLOTS];
+    if (outputPool[previous].timestamp <= timestamp) break;
+    queue.ring[(queue.head + pos) % OUTPUT_POOL_SLOTS] = previous;
+    pos--;
+  }
+  queue.ring[(queue.head + pos) % OUTPUT_POOL_SLOTS] = slot;
+  queue.count++;
+  if (queue.count > queue.highWater) queue.highWater = queue.count;
+  outputCount++;
+  if (outputCount > outputHighWater) outputHighWater = outputCount;
+  portEXIT_CRITICAL(&outputLock);
+}
+
+// Deficit round robin: each turn a queue earns weight * OUTPUT_QUANTUM
+// bytes and sends heads while they fit. Caller holds outputLock.
+int popScheduledOutput() {
+  int slot = -1;
+  while (outputCount > 0) {
+    OutputQueue& queue = outputQueues[outputTurn];
+    if (queue.count > 0) {
+      if (!outputTurnStarted) {
+        queue.deficit += queue.weight * OUTPUT_QUANTUM;
+        outputTurnStarted = true;
+      }
+      int length = outputPool[queue.ring[queue.head]].length;
+      if (length <= queue.deficit) {
+        queue.deficit -= length;
+        slot = popOutputHead(queue);
+        if (queue.count > 0) break;
+      }
+    }
+    // Queue empty or out of deficit: an empty queue does not bank credit
+    if (queue.count == 0) queue.deficit = 0;
+    outputTurn = (outputTurn + 1) % outputQueueCount;
+    outputTurnStarted = false;
+    if (slot != -1) break;
+  }
+  return slot;
+}
+
+// k-way merge of the queue heads: the earliest arrival, once it has arrived
+// before cutoff. enqueueOutput() keeps each queue in arrival order, so only
+// the heads need comparing. Caller holds outputLock.
+int popMergedOutput(int64_t cutoff) {
+  OutputQueue* oldest = nullptr;
+  int64_t oldestTime = 0;
+  for (int i = 0; i < outputQueueCount; i++) {
+    OutputQueue& queue = outputQueues[i];
+    if (queue.count == 0) continue;
+    int64_t timestamp = outputPool[queue.ring[queue.head]].timestamp;
+    if (oldest == nullptr || timestamp < oldestTime) {
+      oldest = &queue;
+      oldestTime = timestamp;
+    }
+  }
+  if (oldest == nullptr || oldestTime > cutoff) return -1;
+  return popOutputHead(*oldest);
+}
+
+// Next record to write, or -1; the slot stays reserved until releaseOutput().
+int dequeueOutput() {
+  int64_t cutoff = esp_timer_get_time() - mergeHoldUs;
+  portENTER_CRITICAL(&outputLock);
+  int slot = mergeOutput ? popMergedOutput(cutoff) : popScheduledOutput();
+  portEXIT_CRITICAL(&outputLock);
+  return slot;
+}
+
+void releaseOutput(int slot) {
+  portENTER_CRITICAL(&outputLock);
+  outputFree[outputFreeCount++] = slot;
+  portEXIT_CRITICAL(&outputLock);
+}
+
+//-------------------------//
+// Capture Buffer          //
+//-------------------------//
+
+// Raw notifications recorded into a PSRAM ring, independent of the UART
+// queue, and read back in bulk with AT+CAPDUMP. While armed the ring keeps
+// the newest data; once triggered it records until the post-trigger share
+// of the ring is used and never overwrites anything after the trigger.
+
+// Ring size used when AT+CAPARM gives none, capped by free PSRAM
+#define CAPTURE_DEFAULT_KB 2048
+// PSRAM left free for other allocations
+#define CAPTURE_RESERVE_KB 64
+// Largest binary chunk AT+CAPDUMP sends at once
+#define CAPTURE_CHUNK_BYTES 4096
+// Header length meaning "rest of the ring unused, continue at offset 0"
+#define CAPTURE_WRAP 0xFFFF
+
+// Stored and dumped as-is, followed by length bytes of payload (little endian)
+struct __attribute__((packed)) CaptureHeader {
+  int64_t timestamp;  // esp_timer time of arrival
+  uint16_t length;
+  uint8_t clientId;   // 0xFF for an unmapped characteristic
+  uint8_t streamId;
+};
+
+enum CaptureState { CAPTURE_IDLE, CAPTURE_ARMED, CAPTURE_TRIGGERED, CAPTURE_DONE };
+
+enum CaptureTrigger {
+  TRIGGER_NOW,     // Start recording post-trigger data right away
+  TRIGGER_MANUAL,  // Wait for AT+CAPTRIG
+  TRIGGER_DROP,    // First output drop after arming
+  TRIGGER_CLIENT,  // First notification from a client
+  TRIGGER_BYTE     // Payload byte at an offset equals a value
+};
+
+uint8_t* captureBuffer = nullptr;
+size_t captureSize = 0;
+size_t captureHead = 0;    // next write offset
+size_t captureTail = 0;    // oldest record
+size_t captureUsed = 0;    // bytes from tail to head, wrap gaps included
+uint32_t captureRecords = 0;
+uint32_t captureOverwritten = 0;  // pre-trigger records given up for newer ones
+volatile CaptureState captureState = CAPTURE_IDLE;
+CaptureTrigger captureTrigger = TRIGGER_NOW;
+int captureTriggerClient = 0;
+int captureTriggerOffset = 0;
+uint8_t captureTriggerValue = 0;
+uint32_t captureTriggerDrops = 0;  // outputDropped when armed
+int64_t captureTriggerTime = 0;
+size_t capturePostBytes = 0;       // left to record after the trigger
+int capturePostPercent = 50;
+portMUX_TYPE captureLock = portMUX_INITIALIZER_UNLOCKED;
+
+// Parse NOW, MANUAL, DROP, CLIENT:<id> or BYTE:<offset>:<hex value>.
+bool parseCaptureTrigger(String trigger) {
+  if (trigger == "NOW") {
+    captureTrigger = TRIGGER_NOW;
+  } else if (trigger == "MANUAL") {
+    captureTrigger = TRIGGER_MANUAL;
+  } else if (trigger == "DROP") {
+    captureTrigger = TRIGGER_DROP;
+  } else if (trigger.startsWith("CLIENT:")) {
+    captureTrigger = TRIGGER_CLIENT;
+    captureTriggerClient = trigger.substring(String("CLIENT:").length()).toInt();
+  } else if (trigger.startsWith("BYTE:")) {
+    int colon = trigger.indexOf(":", String("BYTE:").length());
+    if (colon == -1) return false;
+    String offsetStr = trigger.substring(String("BYTE:").length(), colon);
+    String valueStr = trigger.substring(colon + 1);
+    char* end = nullptr;
+    long offset = strtol(offsetStr.c_str(), &end, 10);
+    if (offsetStr.length() == 0 || *end != '\0' || offset < 0 || offset >= MAX_NOTIFY_LENGTH) return false;
+    long value = strtol(valueStr.c_str(), &end, 16);
+    if (valueStr.length() == 0 || valueStr.length() > 2 || *end != '\0' || value < 0) return false;
+    captureTrigger = TRIGGER_BYTE;
+    captureTriggerOffset = offset;
+    captureTriggerValue = value;
+  } else {
+    return false;
+  }
+  return true;
+}
+
+// Caller holds captureLock.
+void startCapturePostTrigger(int64_t now) {
+  captureState = CAPTURE_TRIGGERED;
+  captureTriggerTime = now;
+  capturePostBytes = captureSize / 100 * capturePostPercent;
+}
+
+// (Re)allocate the ring and arm it. Returns the ring size, 0 without PSRAM.
+size_t armCapture(int sizeKb, int postPercent) {
+  portENTER_CRITICAL(&captureLock);
+  captureState = CAPTURE_IDLE;
+  portEXIT_CRITICAL(&captureLock);
+  if (!psramFound()) return 0;
+  size_t available = heap_caps_get_largest_free_block(MALLOC_CAP_SPIRAM) + captureSize;
+  size_t size = (sizeKb > 0 ? sizeKb : CAPTURE_DEFAULT_KB) * 1024;
+  if (size + CAPTURE_RESERVE_KB * 1024 > available) {
+    size = available > CAPTURE_RESERVE_KB * 1024 ? available - CAPTURE_RESERVE_KB * 1024 : 0;
+  }
+  if (size < 4 * (sizeof(CaptureHeader) + MAX_NOTIFY_LENGTH)) return 0;
+  if (size != captureSize) {
+    heap_caps_free(captureBuffer);
+    captureSize = 0;
+    captureBuffer = (uint8_t*)heap_caps_malloc(size, MALLOC_CAP_SPIRAM);
+    if (captureBuffer == nullptr) return 0;
+    captureSize = size;
+  }
+  portENTER_CRITICAL(&captureLock);
+  captureHead = 0;
+  captureTail = 0;
+  captureUsed = 0;
+  captureRecords = 0;
+  captureOverwritten = 0;
+  capturePostPercent = postPercent;
+  captureTriggerDrops = outputDropped;
+  captureTriggerTime = 0;
+  captureState = CAPTURE_ARMED;
+  if (captureTrigger == TRIGGER_NOW) startCapturePostTrigger(esp_timer_get_time());
+  portEXIT_CRITICAL(&captureLock);
+  return captureSize;
+}
+
+// Offset of the next record at or after offset, skipping a wrap gap.
+inline size_t captureNext(size_t offset) {
+  if (captureSize - offset < sizeof(CaptureHeader)) return 0;
+  CaptureHeader header;
+  memcpy(&header, captureBuffer + offset, sizeof(header));
+  return header.length == CAPTURE_WRAP ? 0 : offset;
+}
+
+// Give up the oldest record. Returns false when that would lose data
+// recorded after the trigger. Caller holds captureLock.
+bool captureEvict() {
+  size_t offset = captureNext(captureTail);
+  if (offset != captureTail) {
+    captureUsed -= captureSize - captureTail;
+    captureTail = 0;
+    return true;
+  }
+  CaptureHeader header;
+  memcpy(&header, captureBuffer + captureTail, sizeof(header));
+  if (captureState == CAPTURE_TRIGGERED && header.timestamp >= captureTriggerTime) return false;
+  size_t recordLength = sizeof(header) + header.length;
+  captureTail = (captureTail + recordLength) % captureSize;
+  captureUsed -= recordLength;
+  captureRecords--;
+  captureOverwritten++;
+  return true;
+}
+
+// Find contiguous room for a record, evicting old ones as needed.
+// Returns the write offset, or -1 when the capture has to stop.
+// Caller holds captureLock.
+int captureReserve(size_t recordLength) {
+  for (;;) {
+    if (captureUsed == 0) {
+      captureHead = 0;
+      captureTail = 0;
+    }
+    bool wrapped = captureHead < captureTail || (captureHead == captureTail && captureUsed > 0);
+    if (wrapped) {
+      if (captureTail - captureHead >= recordLength) return captureHead;
+    } else {
+      if (captureSize - captureHead >= recordLength) return captureHead;
+      if (captureTail >= recordLength) {
+        // Mark the unused end so readers continue at the start
+        if (captureSize - captureHead >= sizeof(CaptureHeader)) {
+          CaptureHeader wrap = {0, CAPTURE_WRAP, 0, 0};
+          memcpy(captureBuffer + captureHead, &wrap, sizeof(wrap));
+        }
+        captureUsed += captureSize - captureHead;
+        captureHead = 0;
+        return 0;
+      }
+    }
+    if (!captureEvict()) return -1;
+  }
+}
+
+bool captureTriggerMatches(int clientId, const uint8_t* data, size_t length) {
+  switch (captureTrigger) {
+    case TRIGGER_DROP:
+      return outputDropped != captureTriggerDrops;
+    case TRIGGER_CLIENT:
+      return clientId == captureTriggerClient;
+    case TRIGGER_BYTE:
+      return captureTriggerOffset < (int)length && data[captureTriggerOffset] == captureTriggerValue;
+    default:
+      return false;
+  }
+}
+
+// Record one notification. Runs on the BLE and poll tasks.
+void captureNotification(int clientId, int streamId, int64_t timestamp, const uint8_t* data, size_t length) {
+  if (captureState != CAPTURE_ARMED && captureState != CAPTURE_TRIGGERED) return;
+  if (length > MAX_NOTIFY_LENGTH) length = MAX_NOTIFY_LENGTH;
+  size_t recordLength = sizeof(CaptureHeader) + length;
+  portENTER_CRITICAL(&captureLock);
+  if (captureState == CAPTURE_ARMED && captureTriggerMatches(clientId, data, length)) {
+    startCapturePostTrigger(timestamp);
+  }
+  int offset = captureState == CAPTURE_ARMED || captureState == CAPTURE_TRIGGERED ? captureReserve(recordLength) : -1;
+  if (offset < 0) {
+    if (captureState == CAPTURE_TRIGGERED) captureState = CAPTURE_DONE;
+  } else {
+    CaptureHeader header = {timestamp, (uint16_t)length, (uint8_t)clientId, (uint8_t)streamId};
+    memcpy(captureBuffer + offset, &header, sizeof(header));
+    memcpy(captureBuffer + offset + sizeof(header), data, length);
+    captureHead = (offset + recordLength) % captureSize;
+    captureUsed += recordLength;
+    captureRecords++;
+    if (captureState == CAPTURE_TRIGGERED) {
+      if (capturePostBytes <= recordLength) captureState = CAPTURE_DONE;
+      else capturePostBytes -= recordLength;
+    }
+  }
+  portEXIT_CRITICAL(&captureLock);
+}
+
+void stopCapture() {
+  portENTER_CRITICAL(&captureLock);
+  if (captureState == CAPTURE_ARMED || captureState == CAPTURE_TRIGGERED) captureState = CAPTURE_DONE;
+  portEXIT_CRITICAL(&captureLock);
+}
+
+// Stream the capture, oldest first, as "+CAPDUMP:<records>,<bytes>,<trigger_us>"
+// followed by "+CAPDATA:<n>" lines each carrying n bytes of whole records.
+void dumpCapture() {
+  stopCapture();
+  size_t bytes = 0;
+  size_t offset = captureTail;
+  for (uint32_t n = 0; n < captureRecords; n++) {
+    offset = captureNext(offset);
+    CaptureHeader header;
+    memcpy(&header, captureBuffer + offset, sizeof(header));
+    bytes += sizeof(header) + header.length;
+    offset = (offset + sizeof(header) + header.length) % captureSize;
+  }
+  Serial.printf("+CAPDUMP:%u,%u,%lld\r\n", captureRecords, bytes, captureTriggerTime);
+  offset = captureTail;
+  uint32_t n = 0;
+  while (n < captureRecords) {
+    // Whole records up to the chunk size; they never straddle the end of the ring
+    size_t start = captureNext(offset);
+    size_t chunk = 0;
+    offset = start;
+    while (n < captureRecords && captureNext(offset) == offset) {
+      CaptureHeader header;
+      memcpy(&header, captureBuffer + offset, sizeof(header));
+      size_t recordLength = sizeof(header) + header.length;
+      if (chunk > 0 && chunk + recordLength > CAPTURE_CHUNK_BYTES) break;
+      chunk += recordLength;
+      offset = (offset + recordLength) % captureSize;
+      n++;
+      if (offset == 0) break;
+    }
+    Serial.printf("+CAPDATA:%u\r\n", chunk);
+    Serial.write(captureBuffer + start, chunk);
+  }
+}
 
 //-------------------------//
 // Notification Callback   //
 //-------------------------//
 
+static const char hexDigits[] = "0123456789ABCDEF";
+
+// Write a line to the UART, accounting bytes and TX stalls.
+void perfSerialWrite(const uint8_t* buf, size_t len) {
+  int room = Serial.availableForWrite();
+  int pending = perfUartTxCapacity - room;
+  if (pending > perfUartTxHighWater) perfUartTxHighWater = pending;
+  if (room < (int)len) {
+    perfUartStalls++;
+    perfUartStalledBytes += len - room;
+  }
+  uint32_t start = ESP.getCycleCount();
+  Serial.write(buf, len);
+  perfRecord(perfUartWrite, ESP.getCycleCount() - start);
+  perfUartBytes += len;
+}
+
+// Count a value delivered on a stream and its gap since the previous one.
+void recordStreamArrival(NotifyStream& stream, int64_t now) {
+  if (stream.notifyCount > 0) {
+    perfRecord(stream.gap, (uint32_t)(now - stream.lastArrival));
+  }
+  stream.lastArrival = now;
+  stream.notifyCount++;
+}
+
 void notifyCallback(
-  BLERemoteCharacteristic* pBLERemoteCharacteristic,
+  BleRemoteCharacteristic* pBLERemoteCharacteristic,
   uint8_t* pData,
   size_t length,
   bool isNotify) {
-  
+  uint32_t start = ESP.getCycleCount();
+  int64_t now = esp_timer_get_time();
+
+  BLEClientConnection* connection = nullptr;
   int clientId = -1;
-  if (notifyMap.find(pBLERemoteCharacteristic) != notifyMap.end()) {
-    clientId = notifyMap[pBLERemoteCharacteristic];
-  }
-  Serial.print("0");
-  Serial.print(clientId, HEX);
-  Serial.print(" ");
-  for (size_t i = 0; i < length; i++) {
-    uint8_t byte = pData[i];
-    if (byte < 0x10) Serial.print("0");
-    Serial.print(byte, HEX);
-    Serial.print(" ");
+  int streamId = 0;
+  auto it = notifyMap.find(pBLERemoteCharacteristic);
+  if (it != notifyMap.end()) {
+    NotifyStream* stream = it->second;
+    connection = stream->connection;
+    clientId = connection->clientId;
+    streamId = stream->streamId;
+    recordStreamArrival(*stream, now);
+  }
+  captureNotification(clientId, streamId, now, pData, length);
+  enqueueOutput(connection, clientId, streamId, now, pData, length);
+
+  perfRecord(perfNotify, ESP.getCycleCount() - start);
+}
+
+// Longest line writeRecord() can produce
+#define MAX_LINE_LENGTH (48 + 3 * MAX_NOTIFY_LENGTH)
+
+// Format a record as "0<clientId>:<streamId> XX XX ..." and write it in one go.
+// In merge mode the id is followed by "@<arrival_us>".
+void writeRecord(const OutputRecord& record) {
+  static char line[MAX_LINE_LENGTH];
+  size_t pos = 0;
+  line[pos++] = '0';
+  pos += snprintf(line + pos, 16, "%X:%X", (unsigned)record.clientId, (unsigned)record.streamId);
+  if (mergeOutput) {
+    pos += snprintf(line + pos, 24, "@%lld", record.timestamp);
+  }
+  line[pos++] = ' ';
+  for (size_t i = 0; i < record.length; i++) {
+    line[pos++] = hexDigits[record.data[i] >> 4];
+    line[pos++] = hexDigits[record.data[i] & 0x0F];
+    line[pos++] = ' ';
+  }
+  line[pos++] = '\r';
+  line[pos++] = '\n';
+  perfSerialWrite((const uint8_t*)line, pos);
+}
+
+// Tell the host about drops it has not heard of yet.
+void reportDrops() {
+  uint32_t unmapped = unmappedDropped;
+  if (unmapped != unmappedDroppedReported) {
+    Serial.printf("+DROP:0,%u,%u\r\n", unmapped - unmappedDroppedReported, unmapped);
+    unmappedDroppedReported = unmapped;
+  }
+  for (auto const& clientPair : clientConnections) {
+    BLEClientConnection* connection = clientPair.second;
+    uint32_t dropped = connection->dropped;
+    if (dropped != connection->droppedReported) {
+      Serial.printf("+DROP:%d,%u,%u\r\n", clientPair.first, dropped - connection->droppedReported, dropped);
+      connection->droppedReported = dropped;
+    }
+  }
+}
+
+// Move queued notifications to the UART while the host has credit and the
+// TX buffer has room for a full line; anything left waits for the next pass.
+void drainOutput() {
+  if (outputBlocked()) return;
+  reportDrops();
+  for (int n = 0; n < OUTPUT_DRAIN_BATCH && !outputBlocked(); n++) {
+    if (Serial.availableForWrite() < MAX_LINE_LENGTH) break;
+    int slot = dequeueOutput();
+    if (slot < 0) break;
+    OutputRecord& record = outputPool[slot];
+    perfRecord(outputQueues[record.queue].delay, (uint32_t)(esp_timer_get_time() - record.timestamp));
+    writeRecord(record);
+    releaseOutput(slot);
+    if (flowControl) outputCredits--;
   }
-  Serial.println();
 }
 
 //-------------------------//
@@ -79,7 +757,7 @@ void notifyCallback(
 
 void startBLE() {
   if (!bleInitialized) {
-    BLEDevice::init("ESP32-AT");
+    bleInit("ESP32-AT");
     bleInitialized = true;
     Serial.println("BLE initialized");
   } else {
@@ -97,7 +775,7 @@ void stopBLE() {
 
 void startAdvertising() {
   if (bleInitialized) {
-    BLEAdvertising *pAdvertising = BLEDevice::getAdvertising();
+    BleAdvertising *pAdvertising = BleDevice::getAdvertising();
     if (!bleAdvertising) {
       pAdvertising->start();
       bleAdvertising = true;
@@ -112,7 +790,7 @@ void startAdvertising() {
 
 void stopAdvertising() {
   if (bleInitialized) {
-    BLEAdvertising *pAdvertising = BLEDevice::getAdvertising();
+    BleAdvertising *pAdvertising = BleDevice::getAdvertising();
     if (bleAdvertising) {
       pAdvertising->stop();
       bleAdvertising = false;
@@ -125,6 +803,136 @@ void stopAdvertising() {
   }
 }
 
+//-------------------------//
+// Characteristic Polling  //
+//-------------------------//
+
+#define MIN_POLL_INTERVAL_MS 10
+#define MAX_POLL_INTERVAL_MS 60000
+// Ceiling for the period while reads keep failing
+#define MAX_POLL_BACKOFF_MS 5000
+// Longest the poll task sleeps before looking for new or retimed streams
+#define POLL_SLEEP_SLICE_MS 20
+#define MAX_POLLED_STREAMS 32
+
+// Streams with polling on, all served by one task in order of their next read.
+// pollInFlight is the stream being read; it is not changed until the read ends.
+portMUX_TYPE pollLock = portMUX_INITIALIZER_UNLOCKED;
+NotifyStream* polledStreams[MAX_POLLED_STREAMS];
+int polledCount = 0;
+NotifyStream* pollInFlight = nullptr;
+TaskHandle_t pollTaskHandle = nullptr;
+
+// Read one stream and queue the value like a notification. A failed or empty
+// read doubles the period up to MAX_POLL_BACKOFF_MS; every good read halves
+// it back towards the interval.
+void pollStream(NotifyStream& stream, uint32_t interval, BleRemoteCharacteristic* characteristic) {
+  BLEClientConnection* connection = stream.connection;
+  int64_t start = esp_timer_get_time();
+  bool ok = false;
+  if (connection->client->isConnected() && characteristic != nullptr) {
+    xSemaphoreTake(connection->readMutex, portMAX_DELAY);
+    std::string value = bleReadValue(characteristic);
+    xSemaphoreGive(connection->readMutex);
+    if (!value.empty()) {
+      int64_t now = esp_timer_get_time();
+      recordStreamArrival(stream, now);
+      captureNotification(connection->clientId, stream.streamId, now,
+                          (const uint8_t*)value.data(), value.size());
+      enqueueOutput(connection, connection->clientId, stream.streamId, now,
+                    (const uint8_t*)value.data(), value.size());
+      ok = true;
+    }
+  }
+  uint32_t period = stream.pollPeriodMs < interval ? interval : stream.pollPeriodMs;
+  if (ok) {
+    stream.pollReads++;
+    period = period / 2 < interval ? interval : period / 2;
+  } else {
+    stream.pollFailures++;
+    uint32_t ceiling = interval > MAX_POLL_BACKOFF_MS ? interval : MAX_POLL_BACKOFF_MS;
+    period = period * 2 > ceiling ? ceiling : period * 2;
+  }
+  stream.pollPeriodMs = period;
+  // Reads that take longer than the period run back to back
+  stream.pollDue = start + period * 1000LL;
+}
+
+// Serve every polled stream, reading whichever is due first.
+void pollTask(void* param) {
+  for (;;) {
+    int64_t now = esp_timer_get_time();
+    int64_t due = now + POLL_SLEEP_SLICE_MS * 1000LL;
+    NotifyStream* stream = nullptr;
+    uint32_t interval = 0;
+    BleRemoteCharacteristic* characteristic = nullptr;
+    portENTER_CRITICAL(&pollLock);
+    for (int i = 0; i < polledCount; i++) {
+      if (polledStreams[i]->pollDue < due) {
+        stream = polledStreams[i];
+        due = stream->pollDue;
+      }
+    }
+    if (stream != nullptr && due <= now) {
+      pollInFlight = stream;
+      interval = stream->pollIntervalMs;
+      characteristic = stream->remoteCharacteristicPtr;
+    }
+    portEXIT_CRITICAL(&pollLock);
+    if (due > now) {
+      vTaskDelay(pdMS_TO_TICKS((due - now + 999) / 1000));
+      continue;
+    }
+    pollStream(*stream, interval, characteristic);
+    portENTER_CRITICAL(&pollLock);
+    pollInFlight = nullptr;
+    portEXIT_CRITICAL(&pollLock);
+  }
+}
+
+// Start, retime or (intervalMs 0) stop polling of one stream, after waiting
+// for a read of it in flight. Returns false if polling could not be started.
+bool setStreamPoll(NotifyStream& stream, uint32_t intervalMs) {
+  if (intervalMs > 0 && pollTaskHandle == nullptr &&
+      xTaskCreate(pollTask, "poll", 4096, nullptr, 1, &pollTaskHandle) != pdPASS) {
+    pollTaskHandle = nullptr;
+    return false;
+  }
+  for (;;) {
+    portENTER_CRITICAL(&pollLock);
+    if (pollInFlight != &stream) break;
+    portEXIT_CRITICAL(&pollLock);
+    vTaskDelay(pdMS_TO_TICKS(5));
+  }
+  int index = 0;
+  while (index < polledCount && polledStreams[index] != &stream) index++;
+  bool ok = true;
+  if (intervalMs == 0) {
+    if (index < polledCount) polledStreams[index] = polledStreams[--polledCount];
+  } else if (index == MAX_POLLED_STREAMS) {
+    ok = false;
+  } else {
+    if (index == polledCount) {
+      polledStreams[polledCount++] = &stream;
+      stream.pollReads = 0;
+      stream.pollFailures = 0;
+    }
+    stream.pollPeriodMs = intervalMs;
+    stream.pollDue = esp_timer_get_time();
+  }
+  if (ok) stream.pollIntervalMs = intervalMs;
+  portEXIT_CRITICAL(&pollLock);
+  return ok;
+}
+
+// Stop polling and wait for a read in flight, so the stream's characteristic
+// can be changed. Returns the interval to restart with, 0 if it was not polled.
+uint32_t stopStreamPoll(NotifyStream& stream) {
+  uint32_t intervalMs = stream.pollIntervalMs;
+  setStreamPoll(stream, 0);
+  return intervalMs;
+}
+
 //-------------------------//
 // Client Mode Functions   //
 //-------------------------//
@@ -135,16 +943,16 @@ void setClientName(String name) {
 
 void scanBLEDevices() {
   if (!bleInitialized) {
-    BLEDevice::init("ESP32-AT");
+    bleInit("ESP32-AT");
     bleInitialized = true;
   }
   Serial.println("Starting BLE scan...");
-  BLEScan* pBLEScan = BLEDevice::getScan();
+  BleScan* pBLEScan = BleDevice::getScan();
   pBLEScan->setActiveScan(true);
-  BLEScanResults foundDevices = pBLEScan->start(5, false);
+  BleScanResults foundDevices = pBLEScan->start(5, false);
   int count = foundDevices.getCount();
   for (int i = 0; i < count; i++) {
-    BLEAdvertisedDevice device = foundDevices.getDevice(i);
+    BleAdvertisedDevice device = foundDevices.getDevice(i);
     if ((device.haveName() && device.getName() == clientName.c_str()) || (clientName.length() == 0)) {
       Serial.printf("%s", device.getAddress().toString().c_str());
       Serial.println();
@@ -154,26 +962,72 @@ void scanBLEDevices() {
   Serial.println("Scan complete");
 }
 
-int connectToDeviceMulti(String deviceAddress) {
-  BLEClient* newClient = BLEDevice::createClient();
+// Bookkeeping for a freshly connected client, not yet visible to AT commands.
+BLEClientConnection* createConnection(BleClient* client, String deviceAddress, uint16_t mtu) {
+  BLEClientConnection* connection = new BLEClientConnection();
+  connection->clientId = -1;
+  connection->client = client;
+  connection->deviceAddress = deviceAddress;
+  connection->mtu = mtu;
+  connection->connIntervalMin = 0;
+  connection->connIntervalMax = 0;
+  connection->remoteServicePtr = nullptr;
+  for (int i = 0; i < MAX_STREAMS_PER_CLIENT; i++) {
+    NotifyStream& stream = connection->streams[i];
+    stream.connection = connection;
+    stream.streamId = i;
+    stream.remoteCharacteristicPtr = nullptr;
+    stream.subscribed = false;
+    stream.notifyCount = 0;
+    stream.lastArrival = 0;
+    memset(&stream.gap, 0, sizeof(stream.gap));
+    stream.pollIntervalMs = 0;
+    stream.pollPeriodMs = 0;
+    stream.pollReads = 0;
+    stream.pollFailures = 0;
+    stream.pollDue = 0;
+  }
+  connection->remoteWriteServicePtr = nullptr;
+  connection->remoteWriteCharacteristicPtr = nullptr;
+  connection->readMutex = xSemaphoreCreateMutex();
+  connection->outputQueue = 0;
+  connection->dropped = 0;
+  connection->droppedReported = 0;
+  connection->decimateCounter = 0;
+  return connection;
+}
+
+int registerConnection(BLEClientConnection* connection) {
+  int clientId = nextClientId++;
+  connection->clientId = clientId;
+  connection->outputQueue = assignOutputQueue();
+  clientConnections[clientId] = connection;
+  return clientId;
+}
+
+// The controller opens one connection at a time, and client creation and
+// connect touch unlocked state in both stacks, so every GAP connect holds this.
+SemaphoreHandle_t connectMutex = nullptr;
+
+int connectToDeviceMulti(String deviceAddress, uint16_t mtu) {
+  xSemaphoreTake(connectMutex, portMAX_DELAY);
+  BleClient* newClient = BleDevice::createClient();
   Serial.println("Created BLE client");
-  BLEAddress addr(deviceAddress.c_str());
-  if (newClient->connect(addr)) {
+  BleAddress addr(deviceAddress.c_str());
+  int64_t connectStart = esp_timer_get_time();
+  bool connected = bleConnect(newClient, addr, mtu);
+  if (!connected) bleDeleteClient(newClient);
+  xSemaphoreGive(connectMutex);
+  if (connected) {
+    perfRecord(perfConnect, (uint32_t)(esp_timer_get_time() - connectStart));
     Serial.println("Connected to device: " + deviceAddress);
-    if(newClient->setMTU(128)) {
-      Serial.println("MTU set to 128");
+    if (newClient->getMTU() > 23) {
+      Serial.print("MTU set to ");
+      Serial.println(newClient->getMTU());
     } else {
       Serial.println("MTU negotiation failed or not supported");
     }
-    BLEClientConnection* connection = new BLEClientConnection();
-    connection->client = newClient;
-    connection->deviceAddress = deviceAddress;
-    connection->remoteServicePtr = nullptr;
-    connection->remoteCharacteristicPtr = nullptr;
-    connection->remoteWriteServicePtr = nullptr;
-    connection->remoteWriteCharacteristicPtr = nullptr;
-    int clientId = nextClientId++;
-    clientConnections[clientId] = connection;
+    int clientId = registerConnection(createConnection(newClient, deviceAddress, mtu));
     Serial.print("Assigned Client ID: ");
     Serial.println(clientId);
     return clientId;
@@ -189,21 +1043,16 @@ void discoverServicesMulti(BLEClientConnection* connection) {
     return;
   }
   Serial.println("Discovering services and characteristics...");
-  auto servicesMap = connection->client->getServices();
-  if (servicesMap == nullptr || servicesMap->empty()) {
+  auto services = bleGetServices(connection->client);
+  if (services.empty()) {
     Serial.println("No services found.");
   } else {
-    for (auto const& servicePair : *servicesMap) {
-      BLERemoteService* service = servicePair.second;
+    for (BleRemoteService* service : services) {
       Serial.print("Service: ");
       Serial.println(service->getUUID().toString().c_str());
-      auto characteristicsMap = service->getCharacteristics();
-      if (characteristicsMap != nullptr && !characteristicsMap->empty()) {
-        for (auto const& charPair : *characteristicsMap) {
-          BLERemoteCharacteristic* characteristic = charPair.second;
-          Serial.print("  Characteristic: ");
-          Serial.println(characteristic->getUUID().toString().c_str());
-        }
+      for (BleRemoteCharacteristic* characteristic : bleGetCharacteristics(service)) {
+        Serial.print("  Characteristic: ");
+        Serial.println(characteristic->getUUID().toString().c_str());
       }
     }
   }
@@ -215,11 +1064,14 @@ void readCachedCharacteristicMulti(BLEClientConnection* connection) {
     Serial.println("Client not connected.");
     return;
   }
-  if (connection->remoteCharacteristicPtr == nullptr) {
+  BleRemoteCharacteristic* characteristic = connection->streams[0].remoteCharacteristicPtr;
+  if (characteristic == nullptr) {
     Serial.println("Characteristic pointer not set. Use AT+BLESETSERVICE and AT+BLESETCHAR.");
     return;
   }
-  std::string value = connection->remoteCharacteristicPtr->readValue();
+  xSemaphoreTake(connection->readMutex, portMAX_DELAY);
+  std::string value = bleReadValue(characteristic);
+  xSemaphoreGive(connection->readMutex);
   Serial.print("Read value (hex): ");
   for (size_t i = 0; i < value.size(); i++) {
     uint8_t byte = value[i];
@@ -235,17 +1087,19 @@ void readCharacteristicMulti(BLEClientConnection* connection, String serviceUuid
     Serial.println("Client not connected.");
     return;
   }
-  BLERemoteService* remoteService = connection->client->getService(BLEUUID(serviceUuid.c_str()));
+  BleRemoteService* remoteService = connection->client->getService(BleUUID(serviceUuid.c_str()));
   if (remoteService == nullptr) {
     Serial.println("Service not found: " + serviceUuid);
     return;
   }
-  BLERemoteCharacteristic* remoteCharacteristic = remoteService->getCharacteristic(BLEUUID(charUuid.c_str()));
+  BleRemoteCharacteristic* remoteCharacteristic = remoteService->getCharacteristic(BleUUID(charUuid.c_str()));
   if (remoteCharacteristic == nullptr) {
     Serial.println("Characteristic not found: " + charUuid);
     return;
   }
-  std::string value = remoteCharacteristic->readValue();
+  xSemaphoreTake(connection->readMutex, portMAX_DELAY);
+  std::string value = bleReadValue(remoteCharacteristic);
+  xSemaphoreGive(connection->readMutex);
   Serial.print("Read value (hex): ");
   for (size_t i = 0; i < value.size(); i++) {
     uint8_t byte = value[i];
@@ -256,6 +1110,438 @@ void readCharacteristicMulti(BLEClientConnection* connection, String serviceUuid
   Serial.println();
 }
 
+// Returns false when the CCCD write fails. A failed enable leaves the stream
+// unsubscribed; a failed disable still forgets the stream locally.
+bool setStreamNotify(NotifyStream& stream, bool enable) {
+  bool written;
+  if (enable) {
+    notifyMap[stream.remoteCharacteristicPtr] = &stream;
+    written = bleSubscribe(stream.remoteCharacteristicPtr, notifyCallback);
+    if (!written) {
+      notifyMap.erase(stream.remoteCharacteristicPtr);
+      return false;
+    }
+  } else {
+    written = bleSubscribe(stream.remoteCharacteristicPtr, nullptr);
+    notifyMap.erase(stream.remoteCharacteristicPtr);
+  }
+  stream.subscribed = enable;
+  return written;
+}
+
+// Look up each configured stream's characteristic in the cached service.
+// Pointers are resolved here once and reused for every read and notification.
+// Subscribed streams are moved over to the new characteristic.
+void resolveStreamPointers(BLEClientConnection* connection, bool report) {
+  for (int i = 0; i < MAX_STREAMS_PER_CLIENT; i++) {
+    NotifyStream& stream = connection->streams[i];
+    if (stream.characteristicUUID.length() == 0) continue;
+    bool wasSubscribed = stream.subscribed;
+    if (wasSubscribed) {
+      setStreamNotify(stream, false);
+    }
+    uint32_t pollIntervalMs = stopStreamPoll(stream);
+    stream.remoteCharacteristicPtr = connection->remoteServicePtr->getCharacteristic(BleUUID(stream.characteristicUUID.c_str()));
+    if (pollIntervalMs > 0 && stream.remoteCharacteristicPtr != nullptr) setStreamPoll(stream, pollIntervalMs);
+    bool resubscribed = wasSubscribed && stream.remoteCharacteristicPtr != nullptr && setStreamNotify(stream, true);
+    if (!report) continue;
+    if (stream.remoteCharacteristicPtr != nullptr) {
+      Serial.printf("Characteristic pointer acquired for stream %d.\r\n", i);
+    } else {
+      Serial.printf("Characteristic pointer not found for stream %d.\r\n", i);
+    }
+    if (wasSubscribed && !resubscribed) {
+      Serial.printf("Notifications disabled for stream %d.\r\n", i);
+    }
+  }
+}
+
+// Stream of this client, other than exceptStreamId, configured with the UUID, or -1.
+int findStreamByUUID(BLEClientConnection* connection, String uuid, int exceptStreamId) {
+  for (int i = 0; i < MAX_STREAMS_PER_CLIENT; i++) {
+    if (i != exceptStreamId && connection->streams[i].characteristicUUID.equalsIgnoreCase(uuid)) return i;
+  }
+  return -1;
+}
+
+// Enable or disable notifications for one stream, or for every stream with a
+// resolved characteristic when streamId is -1.
+void setClientNotify(BLEClientConnection* connection, int streamId, bool enable) {
+  if (streamId < -1 || streamId >= MAX_STREAMS_PER_CLIENT) {
+    Serial.println("ERROR: Invalid stream ID.");
+    return;
+  }
+  int changed = 0;
+  int failedStream = -1;
+  for (int i = 0; i < MAX_STREAMS_PER_CLIENT; i++) {
+    if (streamId != -1 && i != streamId) continue;
+    NotifyStream& stream = connection->streams[i];
+    if (stream.remoteCharacteristicPtr == nullptr) continue;
+    if (!setStreamNotify(stream, enable)) failedStream = i;
+    changed++;
+  }
+  if (changed == 0) {
+    Serial.println(enable
+      ? "ERROR: Characteristic pointer not set. Use AT+BLESETSERVICE and AT+BLESETCHAR first."
+      : "ERROR: Characteristic pointer not set.");
+    return;
+  }
+  if (failedStream != -1) {
+    Serial.printf("ERROR: Notification %s failed for stream %d.\r\n", enable ? "enable" : "disable", failedStream);
+    return;
+  }
+  Serial.println(enable ? "Notifications enabled" : "Notifications disabled");
+  Serial.println("OK");
+}
+
+//-------------------------//
+// Performance Reporting   //
+//-------------------------//
+
+// ticksPerUs is the CPU clock in MHz for cycle samples, 1 for microsecond samples.
+void printPerfStat(const char* name, const PerfStat& stat, float ticksPerUs) {
+  float mean = stat.count ? (float)stat.total / stat.count : 0;
+  Serial.printf("+PERF:%s,%u,%.2f,%.2f,%.2f\r\n", name, stat.count,
+                stat.min / ticksPerUs, mean / ticksPerUs, stat.max / ticksPerUs);
+}
+
+// Report all counters: durations as count,min_us,mean_us,max_us.
+void printPerf() {
+  int64_t elapsedUs = esp_timer_get_time() - perfResetTime;
+  float elapsedSec = elapsedUs / 1000000.0;
+  float mhz = getCpuFrequencyMhz();
+  Serial.printf("+PERF:stack,%s,%d\r\n", BLE_STACK_NAME, BLE_MAX_CONNECTIONS);
+  Serial.printf("+PERF:elapsed_ms,%lld\r\n", elapsedUs / 1000);
+  printPerfStat("notify", perfNotify, mhz);
+  printPerfStat("uart_write", perfUartWrite, mhz);
+  printPerfStat("connect", perfConnect, 1);
+  Serial.printf("+PERF:uart,%u,%u,%u,%d\r\n", perfUartBytes, perfUartStalls,
+                perfUartStalledBytes, perfUartTxHighWater);
+  Serial.printf("+PERF:queue,%d,%d,%d,%u\r\n", outputCount, outputHighWater, OUTPUT_POOL_SLOTS, outputDropped);
+  Serial.printf("+PERF:heap,%u,%u,%u\r\n", ESP.getFreeHeap(), ESP.getMinFreeHeap(),
+                heap_caps_get_largest_free_block(MALLOC_CAP_8BIT));
+  for (auto const& cmdPair : perfCommands) {
+    printPerfStat(("cmd," + cmdPair.first).c_str(), cmdPair.second, 1);
+  }
+  for (auto const& clientPair : clientConnections) {
+    BLEClientConnection* connection = clientPair.second;
+    uint32_t clientCount = 0;
+    for (int i = 0; i < MAX_STREAMS_PER_CLIENT; i++) {
+      clientCount += connection->streams[i].notifyCount;
+    }
+    float rate = elapsedSec > 0 ? clientCount / elapsedSec : 0;
+    Serial.printf("+PERF:client,%d,%u,%.1f\r\n", clientPair.first, clientCount, rate);
+    // Output scheduling as sched,<clientId>,weight,queued,highwater and the
+    // queueing delay as delay,<clientId>,count,min_us,mean_us,max_us
+    OutputQueue& queue = outputQueues[connection->outputQueue];
+    Serial.printf("+PERF:sched,%d,%d,%d,%d\r\n", clientPair.first, queue.weight, queue.count, queue.highWater);
+    printPerfStat(("delay," + String(clientPair.first)).c_str(), queue.delay, 1);
+    // Per-stream gaps as stream,<clientId>:<streamId>,count,min_us,mean_us,max_us
+    for (int i = 0; i < MAX_STREAMS_PER_CLIENT; i++) {
+      NotifyStream& stream = connection->streams[i];
+      if (!stream.subscribed && stream.notifyCount == 0) continue;
+      String name = "stream," + String(clientPair.first) + ":" + String(i);
+      printPerfStat(name.c_str(), stream.gap, 1);
+    }
+  }
+}
+
+void resetPerf() {
+  memset(&perfNotify, 0, sizeof(perfNotify));
+  memset(&perfUartWrite, 0, sizeof(perfUartWrite));
+  memset(&perfConnect, 0, sizeof(perfConnect));
+  perfCommands.clear();
+  perfUartBytes = 0;
+  perfUartStalls = 0;
+  perfUartStalledBytes = 0;
+  perfUartTxHighWater = 0;
+  outputHighWater = outputCount;
+  for (int i = 0; i < outputQueueCount; i++) {
+    outputQueues[i].highWater = outputQueues[i].count;
+    memset(&outputQueues[i].delay, 0, sizeof(outputQueues[i].delay));
+  }
+  for (auto const& clientPair : clientConnections) {
+    for (int i = 0; i < MAX_STREAMS_PER_CLIENT; i++) {
+      NotifyStream& stream = clientPair.second->streams[i];
+      stream.notifyCount = 0;
+      memset(&stream.gap, 0, sizeof(stream.gap));
+    }
+  }
+  perfResetTime = esp_timer_get_time();
+}
+
+// Set by processATCommand; unrecognised input shares one latency bucket so
+// line noise cannot grow perfCommands.
+bool commandKnown = false;
+
+// Command name used to bucket latency, e.g. "AT+BLEREAD" or "AT+PERF?".
+String perfCommandKey(String cmd) {
+  if (!commandKnown) return "unknown";
+  cmd.trim();
+  int eq = cmd.indexOf('=');
+  return eq == -1 ? cmd : cmd.substring(0, eq);
+}
+
+//-------------------------//
+// Boot Profile            //
+//-------------------------//
+
+#define PROFILE_MAX_CLIENTS 8
+#define PROFILE_VERSION 1
+#define PROFILE_TIMEOUT_MS 20000
+// Backoff between connect attempts grows by this much up to the maximum
+#define PROFILE_RETRY_STEP_MS 100
+#define PROFILE_RETRY_MAX_MS 1000
+#define CONN_SUPERVISION_TIMEOUT 400  // 10 ms units
+#define ADDRESS_BUFFER_LENGTH 18
+#define UUID_BUFFER_LENGTH 37
+
+// Everything needed to bring one client back to its saved state
+struct ProfileClient {
+  char deviceAddress[ADDRESS_BUFFER_LENGTH];
+  char serviceUUID[UUID_BUFFER_LENGTH];
+  char characteristicUUID[MAX_STREAMS_PER_CLIENT][UUID_BUFFER_LENGTH];
+  char writeServiceUUID[UUID_BUFFER_LENGTH];
+  char writeCharacteristicUUID[UUID_BUFFER_LENGTH];
+  uint8_t notifyMask;  // Bit per stream that was subscribed when saved
+  uint16_t mtu;
+  uint16_t connIntervalMin;
+  uint16_t connIntervalMax;
+};
+
+// Saved as a single NVS blob; the version rejects blobs from older layouts
+struct Profile {
+  uint8_t version;
+  uint8_t count;
+  ProfileClient clients[PROFILE_MAX_CLIENTS];
+};
+
+// One client restored by runProfile(). The job belongs to runProfile()
+// until it times out; an abandoned job is cleaned up by its task.
+struct ProfileJob {
+  ProfileClient entry;
+  int64_t deadline;                 // esp_timer time to give up connecting
+  BLEClientConnection* connection;  // nullptr when the connect failed
+  volatile bool done;
+  bool abandoned;
+};
+
+portMUX_TYPE profileLock = portMUX_INITIALIZER_UNLOCKED;
+
+Preferences preferences;
+
+bool loadProfile(Profile& profile) {
+  preferences.begin("at-bridge", true);
+  size_t length = preferences.getBytes("profile", &profile, sizeof(profile));
+  preferences.end();
+  return length == sizeof(profile) && profile.version == PROFILE_VERSION && profile.count <= PROFILE_MAX_CLIENTS;
+}
+
+// Snapshot the current connections into NVS. Returns the number of clients saved or -1.
+int saveProfile() {
+  static Profile profile;
+  memset(&profile, 0, sizeof(profile));
+  profile.version = PROFILE_VERSION;
+  for (auto const& clientPair : clientConnections) {
+    if (profile.count == PROFILE_MAX_CLIENTS) break;
+    BLEClientConnection* connection = clientPair.second;
+    ProfileClient& entry = profile.clients[profile.count++];
+    strlcpy(entry.deviceAddress, connection->deviceAddress.c_str(), sizeof(entry.deviceAddress));
+    strlcpy(entry.serviceUUID, connection->serviceUUID.c_str(), sizeof(entry.serviceUUID));
+    for (int i = 0; i < MAX_STREAMS_PER_CLIENT; i++) {
+      NotifyStream& stream = connection->streams[i];
+      strlcpy(entry.characteristicUUID[i], stream.characteristicUUID.c_str(), UUID_BUFFER_LENGTH);
+      if (stream.subscribed) entry.notifyMask |= 1 << i;
+    }
+    strlcpy(entry.writeServiceUUID, connection->writeServiceUUID.c_str(), sizeof(entry.writeServiceUUID));
+    strlcpy(entry.writeCharacteristicUUID, connection->writeCharacteristicUUID.c_str(), sizeof(entry.writeCharacteristicUUID));
+    entry.mtu = connection->mtu;
+    entry.connIntervalMin = connection->connIntervalMin;
+    entry.connIntervalMax = connection->connIntervalMax;
+  }
+  preferences.begin("at-bridge", false);
+  size_t written = preferences.putBytes("profile", &profile, sizeof(profile));
+  preferences.end();
+  return written == sizeof(profile) ? profile.count : -1;
+}
+
+void clearProfile() {
+  preferences.begin("at-bridge", false);
+  preferences.remove("profile");
+  preferences.end();
+}
+
+void printProfile() {
+  static Profile profile;
+  if (!loadProfile(profile)) {
+    Serial.println("+PROFILE:0");
+    return;
+  }
+  Serial.printf("+PROFILE:%u\r\n", profile.count);
+  for (int n = 0; n < profile.count; n++) {
+    ProfileClient& entry = profile.clients[n];
+    Serial.printf("+PROFILE:%d,%s,%u,%u,%u,%s,%02X\r\n", n, entry.deviceAddress, entry.mtu,
+                  entry.connIntervalMin, entry.connIntervalMax, entry.serviceUUID, entry.notifyMask);
+    for (int i = 0; i < MAX_STREAMS_PER_CLIENT; i++) {
+      if (entry.characteristicUUID[i][0] == '\0') continue;
+      Serial.printf("+PROFILE:%d:%d,%s\r\n", n, i, entry.characteristicUUID[i]);
+    }
+    if (entry.writeCharacteristicUUID[0] != '\0') {
+      Serial.printf("+PROFILE:%d:W,%s,%s\r\n", n, entry.writeServiceUUID, entry.writeCharacteristicUUID);
+    }
+  }
+}
+
+// Connect one saved client, retrying until its deadline, then resolve its
+// pointers without touching shared state. Discovery and connection updates
+// of different clients overlap; runProfile() registers the results.
+void profileConnectTask(void* param) {
+  ProfileJob* job = (ProfileJob*)param;
+  const ProfileClient& entry = job->entry;
+  BleClient* client = nullptr;
+  BleAddress addr(entry.deviceAddress);
+  bool connected = false;
+  for (int attempt = 1; !connected; attempt++) {
+    int64_t remainingUs = job->deadline - esp_timer_get_time();
+    if (remainingUs <= 0) break;
+    if (xSemaphoreTake(connectMutex, pdMS_TO_TICKS(remainingUs / 1000)) != pdTRUE) break;
+    if (client == nullptr) client = BleDevice::createClient();
+    connected = bleConnect(client, addr, entry.mtu);
+    xSemaphoreGive(connectMutex);
+    if (!connected) {
+      int backoffMs = PROFILE_RETRY_STEP_MS * attempt;
+      vTaskDelay(pdMS_TO_TICKS(backoffMs < PROFILE_RETRY_MAX_MS ? backoffMs : PROFILE_RETRY_MAX_MS));
+    }
+  }
+  if (connected) {
+    BLEClientConnection* connection = createConnection(client, entry.deviceAddress, entry.mtu);
+    if (entry.connIntervalMin > 0) {
+      connection->connIntervalMin = entry.connIntervalMin;
+      connection->connIntervalMax = entry.connIntervalMax;
+      bleUpdateConnParams(client, entry.connIntervalMin, entry.connIntervalMax, 0, CONN_SUPERVISION_TIMEOUT);
+    }
+    connection->serviceUUID = entry.serviceUUID;
+    for (int i = 0; i < MAX_STREAMS_PER_CLIENT; i++) {
+      connection->streams[i].characteristicUUID = entry.characteristicUUID[i];
+    }
+    if (connection->serviceUUID.length() > 0) {
+      connection->remoteServicePtr = client->getService(BleUUID(entry.serviceUUID));
+      if (connection->remoteServicePtr != nullptr) {
+        resolveStreamPointers(connection, false);
+      }
+    }
+    connection->writeServiceUUID = entry.writeServiceUUID;
+    connection->writeCharacteristicUUID = entry.writeCharacteristicUUID;
+    if (connection->writeServiceUUID.length() > 0) {
+      connection->remoteWriteServicePtr = client->getService(BleUUID(entry.writeServiceUUID));
+      if (connection->remoteWriteServicePtr != nullptr && connection->writeCharacteristicUUID.length() > 0) {
+        connection->remoteWriteCharacteristicPtr = connection->remoteWriteServicePtr->getCharacteristic(BleUUID(entry.writeCharacteristicUUID));
+      }
+    }
+    job->connection = connection;
+  }
+  if (!connected && client != nullptr) {
+    xSemaphoreTake(connectMutex, portMAX_DELAY);
+    bleDeleteClient(client);
+    xSemaphoreGive(connectMutex);
+  }
+  // runProfile() may free the job as soon as done is set
+  portENTER_CRITICAL(&profileLock);
+  bool abandoned = job->abandoned;
+  job->done = true;
+  portEXIT_CRITICAL(&profileLock);
+  // Nothing can reach an unregistered link, so do not leave it holding a slot
+  if (abandoned) {
+    if (connected) {
+      xSemaphoreTake(connectMutex, portMAX_DELAY);
+      bleDeleteClient(client);
+      xSemaphoreGive(connectMutex);
+      vSemaphoreDelete(job->connection->readMutex);
+      delete job->connection;
+    }
+    delete job;
+  }
+  vTaskDelete(nullptr);
+}
+
+bool isDeviceConnected(const char* deviceAddress) {
+  for (auto const& clientPair : clientConnections) {
+    if (clientPair.second->deviceAddress.equalsIgnoreCase(deviceAddress)) return true;
+  }
+  return false;
+}
+
+// Bring back every saved client, one task per client, then subscribe and
+// announce the result with one +READY:<ready>,<total>,<ms> URC. Client IDs
+// follow profile order, skipping clients that failed to connect in time.
+// Saved devices that are already connected are left alone and count as ready.
+void runProfile() {
+  static Profile profile;
+  if (!loadProfile(profile) || profile.count == 0) return;
+  if (!bleInitialized) {
+    bleInit("ESP32-AT");
+    bleInitialized = true;
+  }
+  int64_t start = esp_timer_get_time();
+  int64_t deadline = start + PROFILE_TIMEOUT_MS * 1000LL;
+  ProfileJob* jobs[PROFILE_MAX_CLIENTS];
+  int ready = 0;
+  for (int n = 0; n < profile.count; n++) {
+    jobs[n] = nullptr;
+    if (isDeviceConnected(profile.clients[n].deviceAddress)) {
+      ready++;
+      continue;
+    }
+    jobs[n] = new ProfileJob();
+    jobs[n]->entry = profile.clients[n];
+    jobs[n]->deadline = deadline;
+    jobs[n]->connection = nullptr;
+    jobs[n]->done = false;
+    jobs[n]->abandoned = false;
+    if (xTaskCreate(profileConnectTask, "profile", 6144, jobs[n], 1, nullptr) != pdPASS) {
+      jobs[n]->done = true;
+    }
+  }
+  bool allDone = false;
+  while (!allDone && esp_timer_get_time() < deadline) {
+    delay(10);
+    allDone = true;
+    for (int n = 0; n < profile.count; n++) {
+      if (jobs[n] != nullptr && !jobs[n]->done) allDone = false;
+    }
+  }
+  // Jobs still running are handed over to their task, which disconnects
+  // and frees everything once it finishes
+  for (int n = 0; n < profile.count; n++) {
+    if (jobs[n] == nullptr) continue;
+    portENTER_CRITICAL(&profileLock);
+    bool abandoned = !jobs[n]->done;
+    if (abandoned) jobs[n]->abandoned = true;
+    portEXIT_CRITICAL(&profileLock);
+    if (abandoned) jobs[n] = nullptr;
+  }
+  for (int n = 0; n < profile.count; n++) {
+    if (jobs[n] == nullptr) continue;
+    BLEClientConnection* connection = jobs[n]->connection;
+    ProfileClient& entry = jobs[n]->entry;
+    if (connection == nullptr) {
+      delete jobs[n];
+      continue;
+    }
+    registerConnection(connection);
+    // Only clients with every saved subscription restored count as ready
+    bool subscribed = true;
+    for (int i = 0; i < MAX_STREAMS_PER_CLIENT; i++) {
+      NotifyStream& stream = connection->streams[i];
+      if (!(entry.notifyMask & (1 << i))) continue;
+      if (stream.remoteCharacteristicPtr == nullptr || !setStreamNotify(stream, true)) subscribed = false;
+    }
+    if (subscribed) ready++;
+    delete jobs[n];
+  }
+  Serial.printf("+READY:%d,%u,%lld\r\n", ready, profile.count, (esp_timer_get_time() - start) / 1000);
+}
+
 //-------------------------//
 // AT Command Processing   //
 //-------------------------//
@@ -264,6 +1550,7 @@ String inputBuffer = "";
 
 void processATCommand(String cmd) {
   cmd.trim();  // Remove extra whitespace
+  commandKnown = true;
   if (cmd == "AT") {
     Serial.println("OK");
   }
@@ -271,6 +1558,14 @@ void processATCommand(String cmd) {
     Serial.print("ESP32-S3-AT Firmware Version ");
     Serial.println(VERSION);
   }
+  else if (cmd == "AT+PERF?") {
+    printPerf();
+    Serial.println("OK");
+  }
+  else if (cmd == "AT+PERFRESET") {
+    resetPerf();
+    Serial.println("OK");
+  }
   else if (cmd == "AT+BLESTART") {
     startBLE();
     Serial.println("OK");
@@ -289,15 +1584,22 @@ void processATCommand(String cmd) {
     scanBLEDevices();
     Serial.println("OK");
   }
-  // Connect to device: AT+BLECONNECT=<device_address>
+  // Connect to device: AT+BLECONNECT=<device_address>[,<mtu>]
   else if (cmd.startsWith("AT+BLECONNECT=")) {
     String addr = cmd.substring(String("AT+BLECONNECT=").length());
+    uint16_t mtu = DEFAULT_MTU;
+    int commaIndex = addr.indexOf(",");
+    if (commaIndex != -1) {
+      mtu = addr.substring(commaIndex + 1).toInt();
+      addr = addr.substring(0, commaIndex);
+      if (mtu < 23) mtu = DEFAULT_MTU;
+    }
     addr.trim();
     if (!bleInitialized) {
       Serial.println("ERROR: BLE not initialized.");
       return;
     }
-    int clientId = connectToDeviceMulti(addr);
+    int clientId = connectToDeviceMulti(addr, mtu);
     if (clientId != -1) {
       Serial.print("OK, Client ID: ");
       Serial.println(clientId);
@@ -305,6 +1607,226 @@ void processATCommand(String cmd) {
       Serial.println("ERROR: Connection failed.");
     }
   }
+  // Request a connection interval: AT+BLECONNPARAM=<clientId>,<min_interval>,<max_interval>
+  // Intervals are in 1.25 ms units
+  else if (cmd.startsWith("AT+BLECONNPARAM=")) {
+    String params = cmd.substring(String("AT+BLECONNPARAM=").length());
+    int firstComma = params.indexOf(",");
+    int secondComma = params.indexOf(",", firstComma + 1);
+    if (firstComma == -1 || secondComma == -1) {
+      Serial.println("ERROR: Invalid parameters. Use AT+BLECONNPARAM=<clientId>,<min_interval>,<max_interval>");
+    } else {
+      int clientId = params.substring(0, firstComma).toInt();
+      uint16_t minInterval = params.substring(firstComma + 1, secondComma).toInt();
+      uint16_t maxInterval = params.substring(secondComma + 1).toInt();
+      if (clientConnections.find(clientId) == clientConnections.end()) {
+        Serial.println("ERROR: Client ID not found.");
+      } else if (minInterval < 6 || maxInterval < minInterval || maxInterval > 3200) {
+        Serial.println("ERROR: Invalid connection interval.");
+      } else {
+        BLEClientConnection* connection = clientConnections[clientId];
+        if (bleUpdateConnParams(connection->client, minInterval, maxInterval, 0, CONN_SUPERVISION_TIMEOUT)) {
+          connection->connIntervalMin = minInterval;
+          connection->connIntervalMax = maxInterval;
+          Serial.println("OK");
+        } else {
+          Serial.println("ERROR: Connection parameter update failed.");
+        }
+      }
+    }
+  }
+  // Output share of a client against the others: AT+BLEWEIGHT=<clientId>,<weight>
+  else if (cmd.startsWith("AT+BLEWEIGHT=")) {
+    String params = cmd.substring(String("AT+BLEWEIGHT=").length());
+    int commaIndex = params.indexOf(",");
+    if (commaIndex == -1) {
+      Serial.println("ERROR: Invalid parameters. Use AT+BLEWEIGHT=<clientId>,<weight>");
+    } else {
+      int clientId = params.substring(0, commaIndex).toInt();
+      int weight = params.substring(commaIndex + 1).toInt();
+      if (clientConnections.find(clientId) == clientConnections.end()) {
+        Serial.println("ERROR: Client ID not found.");
+      } else if (weight < 1 || weight > MAX_OUTPUT_WEIGHT) {
+        Serial.println("ERROR: Invalid weight.");
+      } else if (clientConnections[clientId]->outputQueue == 0) {
+        Serial.println("ERROR: Client shares the default output queue.");
+      } else {
+        outputQueues[clientConnections[clientId]->outputQueue].weight = weight;
+        Serial.println("OK");
+      }
+    }
+  }
+  // Firmware-timed reads: AT+BLEPOLL=<clientId>,<interval_ms>[,<streamId>], 0 stops
+  else if (cmd.startsWith("AT+BLEPOLL=")) {
+    String params = cmd.substring(String("AT+BLEPOLL=").length());
+    int firstComma = params.indexOf(",");
+    int secondComma = firstComma == -1 ? -1 : params.indexOf(",", firstComma + 1);
+    if (firstComma == -1) {
+      Serial.println("ERROR: Invalid parameters. Use AT+BLEPOLL=<clientId>,<interval_ms>[,<streamId>]");
+    } else {
+      int clientId = params.substring(0, firstComma).toInt();
+      int intervalMs = params.substring(firstComma + 1, secondComma == -1 ? params.length() : secondComma).toInt();
+      int streamId = secondComma == -1 ? 0 : params.substring(secondComma + 1).toInt();
+      if (clientConnections.find(clientId) == clientConnections.end()) {
+        Serial.println("ERROR: Client ID not found.");
+      } else if (streamId < 0 || streamId >= MAX_STREAMS_PER_CLIENT) {
+        Serial.println("ERROR: Invalid stream ID.");
+      } else if (intervalMs != 0 && (intervalMs < MIN_POLL_INTERVAL_MS || intervalMs > MAX_POLL_INTERVAL_MS)) {
+        Serial.println("ERROR: Invalid poll interval.");
+      } else if (intervalMs != 0 && clientConnections[clientId]->streams[streamId].remoteCharacteristicPtr == nullptr) {
+        Serial.println("ERROR: Characteristic pointer not set. Use AT+BLESETSERVICE and AT+BLESETCHAR first.");
+      } else {
+        if (setStreamPoll(clientConnections[clientId]->streams[streamId], intervalMs)) {
+          Serial.println("OK");
+        } else {
+          Serial.println("ERROR: Could not start polling.");
+        }
+      }
+    }
+  }
+  // Active polls as +BLEPOLL:<clientId>:<streamId>,<interval_ms>,<period_ms>,<reads>,<failures>
+  else if (cmd == "AT+BLEPOLL?") {
+    for (auto const& clientPair : clientConnections) {
+      for (int i = 0; i < MAX_STREAMS_PER_CLIENT; i++) {
+        NotifyStream& stream = clientPair.second->streams[i];
+        if (stream.pollIntervalMs == 0) continue;
+        Serial.printf("+BLEPOLL:%d:%d,%u,%u,%u,%u\r\n", clientPair.first, i, stream.pollIntervalMs,
+                      stream.pollPeriodMs, stream.pollReads, stream.pollFailures);
+      }
+    }
+    Serial.println("OK");
+  }
+  // Host flow control: AT+FLOW=<0|1>[,<OLDEST|NEWEST|DECIMATE>[,<n>]]
+  else if (cmd.startsWith("AT+FLOW=")) {
+    String params = cmd.substring(String("AT+FLOW=").length());
+    int firstComma = params.indexOf(",");
+    int secondComma = firstComma == -1 ? -1 : params.indexOf(",", firstComma + 1);
+    String policy = firstComma == -1 ? "" : params.substring(firstComma + 1, secondComma == -1 ? params.length() : secondComma);
+    policy.trim();
+    int decimation = secondComma == -1 ? outputDecimation : params.substring(secondComma + 1).toInt();
+    if (decimation < 2) {
+      Serial.println("ERROR: Decimation must be at least 2.");
+    } else if (policy.length() > 0 && policy != "OLDEST" && policy != "NEWEST" && policy != "DECIMATE") {
+      Serial.println("ERROR: Invalid parameters. Use AT+FLOW=<0|1>[,<OLDEST|NEWEST|DECIMATE>[,<n>]]");
+    } else {
+      if (policy == "OLDEST") dropPolicy = DROP_OLDEST;
+      else if (policy == "NEWEST") dropPolicy = DROP_NEWEST;
+      else if (policy == "DECIMATE") dropPolicy = DECIMATE;
+      outputDecimation = decimation;
+      outputCredits = 0;
+      flowControl = params.toInt() != 0;
+      Serial.println("OK");
+    }
+  }
+  else if (cmd == "AT+FLOW?") {
+    static const char* policyNames[] = {"OLDEST", "NEWEST", "DECIMATE"};
+    Serial.printf("+FLOW:%d,%s,%d,%d,%d,%u\r\n", flowControl, policyNames[dropPolicy], outputDecimation,
+                  outputCredits, outputCount, outputDropped);
+    Serial.println("OK");
+  }
+  // Time-ordered output across clients: AT+MERGE=<0|1>[,<hold_ms>]
+  else if (cmd.startsWith("AT+MERGE=")) {
+    String params = cmd.substring(String("AT+MERGE=").length());
+    int commaIndex = params.indexOf(",");
+    int holdMs = commaIndex == -1 ? mergeHoldUs / 1000 : params.substring(commaIndex + 1).toInt();
+    if (holdMs < 0 || holdMs > MAX_MERGE_HOLD_MS) {
+      Serial.println("ERROR: Invalid hold time.");
+    } else {
+      mergeHoldUs = holdMs * 1000LL;
+      mergeOutput = params.toInt() != 0;
+      Serial.println("OK");
+    }
+  }
+  else if (cmd == "AT+MERGE?") {
+    Serial.printf("+MERGE:%d,%lld\r\n", mergeOutput, mergeHoldUs / 1000);
+    Serial.println("OK");
+  }
+  // Grant output credit, one per notification line: AT+CREDIT=<n>
+  else if (cmd.startsWith("AT+CREDIT=")) {
+    int credits = cmd.substring(String("AT+CREDIT=").length()).toInt();
+    if (credits <= 0) {
+      Serial.println("ERROR: Invalid credit count.");
+    } else {
+      outputCredits += credits;
+      Serial.println("OK");
+    }
+  }
+  // Burst capture: AT+CAPARM=<trigger>[,<post_percent>[,<size_kb>]]
+  // trigger is NOW, MANUAL, DROP, CLIENT:<clientId> or BYTE:<offset>:<hex value>.
+  // NOW has nothing before the trigger, so it always records a full ring.
+  else if (cmd.startsWith("AT+CAPARM=")) {
+    String params = cmd.substring(String("AT+CAPARM=").length());
+    int firstComma = params.indexOf(",");
+    int secondComma = firstComma == -1 ? -1 : params.indexOf(",", firstComma + 1);
+    String trigger = params.substring(0, firstComma == -1 ? params.length() : firstComma);
+    trigger.trim();
+    int postPercent = firstComma == -1 ? 50 : params.substring(firstComma + 1, secondComma == -1 ? params.length() : secondComma).toInt();
+    int sizeKb = secondComma == -1 ? 0 : params.substring(secondComma + 1).toInt();
+    stopCapture();
+    if (!parseCaptureTrigger(trigger)) {
+      Serial.println("ERROR: Invalid trigger. Use NOW, MANUAL, DROP, CLIENT:<clientId> or BYTE:<offset>:<value>");
+    } else if (postPercent < 1 || postPercent > 100 || sizeKb < 0) {
+      Serial.println("ERROR: Invalid parameters. Use AT+CAPARM=<trigger>[,<post_percent>[,<size_kb>]]");
+    } else {
+      if (captureTrigger == TRIGGER_NOW) postPercent = 100;
+      size_t size = armCapture(sizeKb, postPercent);
+      if (size == 0) {
+        Serial.println("ERROR: Not enough PSRAM for capture.");
+      } else {
+        Serial.printf("+CAPARM:%u\r\n", size);
+        Serial.println("OK");
+      }
+    }
+  }
+  else if (cmd == "AT+CAPTRIG") {
+    portENTER_CRITICAL(&captureLock);
+    bool armed = captureState == CAPTURE_ARMED;
+    if (armed) startCapturePostTrigger(esp_timer_get_time());
+    portEXIT_CRITICAL(&captureLock);
+    Serial.println(armed ? "OK" : "ERROR: Capture not armed.");
+  }
+  else if (cmd == "AT+CAPSTOP") {
+    stopCapture();
+    Serial.println("OK");
+  }
+  // Capture status: +CAP:<state>,<records>,<bytes_used>,<size>,<overwritten>,<trigger_us>
+  else if (cmd == "AT+CAP?") {
+    static const char* stateNames[] = {"IDLE", "ARMED", "TRIGGERED", "DONE"};
+    Serial.printf("+CAP:%s,%u,%u,%u,%u,%lld\r\n", stateNames[captureState], captureRecords, captureUsed,
+                  captureSize, captureOverwritten, captureTriggerTime);
+    Serial.println("OK");
+  }
+  else if (cmd == "AT+CAPDUMP") {
+    if (captureBuffer == nullptr) {
+      Serial.println("ERROR: Nothing captured.");
+    } else {
+      dumpCapture();
+      Serial.println("OK");
+    }
+  }
+  // Boot profile: AT+PROFILE=SAVE, AT+PROFILE=CLEAR, AT+PROFILE=RUN or AT+PROFILE?
+  else if (cmd == "AT+PROFILE=SAVE") {
+    int saved = saveProfile();
+    if (saved < 0) {
+      Serial.println("ERROR: Profile could not be saved.");
+    } else {
+      Serial.print("Profile saved, clients: ");
+      Serial.println(saved);
+      Serial.println("OK");
+    }
+  }
+  else if (cmd == "AT+PROFILE=CLEAR") {
+    clearProfile();
+    Serial.println("OK");
+  }
+  else if (cmd == "AT+PROFILE=RUN") {
+    runProfile();
+    Serial.println("OK");
+  }
+  else if (cmd == "AT+PROFILE?") {
+    printProfile();
+    Serial.println("OK");
+  }
   // Discover services: AT+BLEDISCOVER=<clientId>
   else if (cmd.startsWith("AT+BLEDISCOVER=")) {
     String param = cmd.substring(String("AT+BLEDISCOVER=").length());
@@ -337,17 +1859,10 @@ void processATCommand(String cmd) {
         Serial.print("Service UUID set to: ");
         Serial.println(svcUuid);
         if (connection->client != nullptr && connection->client->isConnected()) {
-          connection->remoteServicePtr = connection->client->getService(BLEUUID(svcUuid.c_str()));
+          connection->remoteServicePtr = connection->client->getService(BleUUID(svcUuid.c_str()));
           if (connection->remoteServicePtr != nullptr) {
             Serial.println("Service pointer acquired.");
-            if (connection->characteristicUUID.length() > 0) {
-              connection->remoteCharacteristicPtr = connection->remoteServicePtr->getCharacteristic(BLEUUID(connection->characteristicUUID.c_str()));
-              if (connection->remoteCharacteristicPtr != nullptr) {
-                Serial.println("Characteristic pointer acquired.");
-              } else {
-                Serial.println("Characteristic pointer not found.");
-              }
-            }
+            resolveStreamPointers(connection, true);
           } else {
             Serial.println("Service not found on remote device.");
           }
@@ -358,35 +1873,60 @@ void processATCommand(String cmd) {
       }
     }
   }
-  // Set and cache remote characteristic UUID for reading: AT+BLESETCHAR=<clientId>,<char_uuid>
+  // Set and cache remote characteristic UUID for reading:
+  // AT+BLESETCHAR=<clientId>,<char_uuid> or AT+BLESETCHAR=<clientId>,<char_uuid>,<streamId>
   else if (cmd.startsWith("AT+BLESETCHAR=")) {
     String params = cmd.substring(String("AT+BLESETCHAR=").length());
     int commaIndex = params.indexOf(",");
     if (commaIndex == -1) {
-      Serial.println("ERROR: Invalid parameters. Use AT+BLESETCHAR=<clientId>,<char_uuid>");
+      Serial.println("ERROR: Invalid parameters. Use AT+BLESETCHAR=<clientId>,<char_uuid>[,<streamId>]");
     } else {
       String idStr = params.substring(0, commaIndex);
       String charUuid = params.substring(commaIndex + 1);
+      int streamId = 0;
+      int streamComma = charUuid.indexOf(",");
+      if (streamComma != -1) {
+        streamId = charUuid.substring(streamComma + 1).toInt();
+        charUuid = charUuid.substring(0, streamComma);
+      }
       idStr.trim();
       charUuid.trim();
       int clientId = idStr.toInt();
       if (clientConnections.find(clientId) == clientConnections.end()) {
         Serial.println("ERROR: Client ID not found.");
+      } else if (streamId < 0 || streamId >= MAX_STREAMS_PER_CLIENT) {
+        Serial.println("ERROR: Invalid stream ID.");
+      } else if (findStreamByUUID(clientConnections[clientId], charUuid, streamId) != -1) {
+        // Notifications are routed by characteristic, so each one can back only one stream
+        Serial.printf("ERROR: Characteristic already used by stream %d.\r\n",
+                      findStreamByUUID(clientConnections[clientId], charUuid, streamId));
       } else {
         BLEClientConnection* connection = clientConnections[clientId];
-        connection->characteristicUUID = charUuid;
-        Serial.print("Characteristic UUID set to: ");
+        NotifyStream& stream = connection->streams[streamId];
+        bool wasSubscribed = stream.subscribed;
+        if (wasSubscribed) {
+          setStreamNotify(stream, false);
+        }
+        uint32_t pollIntervalMs = stopStreamPoll(stream);
+        stream.characteristicUUID = charUuid;
+        stream.remoteCharacteristicPtr = nullptr;
+        Serial.printf("Characteristic UUID for stream %d set to: ", streamId);
         Serial.println(charUuid);
         if (connection->remoteServicePtr != nullptr) {
-          connection->remoteCharacteristicPtr = connection->remoteServicePtr->getCharacteristic(BLEUUID(charUuid.c_str()));
-          if (connection->remoteCharacteristicPtr != nullptr) {
+          stream.remoteCharacteristicPtr = connection->remoteServicePtr->getCharacteristic(BleUUID(charUuid.c_str()));
+          if (stream.remoteCharacteristicPtr != nullptr) {
+            if (pollIntervalMs > 0) setStreamPoll(stream, pollIntervalMs);
             Serial.println("Characteristic pointer acquired.");
+            if (wasSubscribed) wasSubscribed = !setStreamNotify(stream, true);
           } else {
             Serial.println("Characteristic not found in cached service.");
           }
         } else {
           Serial.println("Service pointer not set. Set service first.");
         }
+        if (wasSubscribed) {
+          Serial.printf("Notifications disabled for stream %d.\r\n", streamId);
+        }
         Serial.println("OK");
       }
     }
@@ -424,42 +1964,28 @@ void processATCommand(String cmd) {
     }
     Serial.println("OK");
   }
-  // Enable notifications: AT+BLENOTIFY=<clientId>
+  // Enable notifications on all streams or one: AT+BLENOTIFY=<clientId>[,<streamId>]
   else if (cmd.startsWith("AT+BLENOTIFY=")) {
-    String idStr = cmd.substring(String("AT+BLENOTIFY=").length());
-    idStr.trim();
-    int clientId = idStr.toInt();
+    String params = cmd.substring(String("AT+BLENOTIFY=").length());
+    int commaIndex = params.indexOf(",");
+    int streamId = commaIndex == -1 ? -1 : params.substring(commaIndex + 1).toInt();
+    int clientId = params.toInt();
     if (clientConnections.find(clientId) == clientConnections.end()) {
       Serial.println("ERROR: Client ID not found.");
     } else {
-      BLEClientConnection* connection = clientConnections[clientId];
-      if (connection->remoteCharacteristicPtr == nullptr) {
-        Serial.println("ERROR: Characteristic pointer not set. Use AT+BLESETSERVICE and AT+BLESETCHAR first.");
-      } else {
-        connection->remoteCharacteristicPtr->registerForNotify(notifyCallback);
-        notifyMap[connection->remoteCharacteristicPtr] = clientId;
-        Serial.println("Notifications enabled");
-        Serial.println("OK");  
-      }
+      setClientNotify(clientConnections[clientId], streamId, true);
     }
   }
-  // Disable notifications: AT+BLENOTIFYOFF=<clientId>
+  // Disable notifications on all streams or one: AT+BLENOTIFYOFF=<clientId>[,<streamId>]
   else if (cmd.startsWith("AT+BLENOTIFYOFF=")) {
-    String idStr = cmd.substring(String("AT+BLENOTIFYOFF=").length());
-    idStr.trim();
-    int clientId = idStr.toInt();
+    String params = cmd.substring(String("AT+BLENOTIFYOFF=").length());
+    int commaIndex = params.indexOf(",");
+    int streamId = commaIndex == -1 ? -1 : params.substring(commaIndex + 1).toInt();
+    int clientId = params.toInt();
     if (clientConnections.find(clientId) == clientConnections.end()) {
       Serial.println("ERROR: Client ID not found.");
     } else {
-      BLEClientConnection* connection = clientConnections[clientId];
-      if (connection->remoteCharacteristicPtr == nullptr) {
-        Serial.println("ERROR: Characteristic pointer not set.");
-      } else {
-        connection->remoteCharacteristicPtr->registerForNotify(nullptr);
-        notifyMap.erase(connection->remoteCharacteristicPtr);
-        Serial.println("Notifications disabled");
-        Serial.println("OK");
-      }
+      setClientNotify(clientConnections[clientId], streamId, false);
     }
   }
   // Set and cache remote service UUID for writing: AT+BLESETWRITESERVICE=<clientId>,<service_uuid>
@@ -482,11 +2008,11 @@ void processATCommand(String cmd) {
         Serial.print("Write Service UUID set to: ");
         Serial.println(svcUuid);
         if (connection->client != nullptr && connection->client->isConnected()) {
-          connection->remoteWriteServicePtr = connection->client->getService(BLEUUID(svcUuid.c_str()));
+          connection->remoteWriteServicePtr = connection->client->getService(BleUUID(svcUuid.c_str()));
           if (connection->remoteWriteServicePtr != nullptr) {
             Serial.println("Write Service pointer acquired.");
             if (connection->writeCharacteristicUUID.length() > 0) {
-              connection->remoteWriteCharacteristicPtr = connection->remoteWriteServicePtr->getCharacteristic(BLEUUID(connection->writeCharacteristicUUID.c_str()));
+              connection->remoteWriteCharacteristicPtr = connection->remoteWriteServicePtr->getCharacteristic(BleUUID(connection->writeCharacteristicUUID.c_str()));
               if (connection->remoteWriteCharacteristicPtr != nullptr) {
                 Serial.println("Write Characteristic pointer acquired.");
               } else {
@@ -523,7 +2049,7 @@ void processATCommand(String cmd) {
         Serial.print("Write Characteristic UUID set to: ");
         Serial.println(charUuid);
         if (connection->remoteWriteServicePtr != nullptr) {
-          connection->remoteWriteCharacteristicPtr = connection->remoteWriteServicePtr->getCharacteristic(BLEUUID(charUuid.c_str()));
+          connection->remoteWriteCharacteristicPtr = connection->remoteWriteServicePtr->getCharacteristic(BleUUID(charUuid.c_str()));
           if (connection->remoteWriteCharacteristicPtr != nullptr) {
             Serial.println("Write Characteristic pointer acquired.");
           } else {
@@ -555,7 +2081,7 @@ void processATCommand(String cmd) {
         if (connection->remoteWriteCharacteristicPtr == nullptr) {
           Serial.println("ERROR: Write Characteristic pointer not set. Use AT+BLESETWRITESERVICE and AT+BLESETWRITECHAR first.");
         } else {
-          connection->remoteWriteCharacteristicPtr->writeValue(data.c_str(), data.length());
+          bleWriteValue(connection->remoteWriteCharacteristicPtr, (const uint8_t*)data.c_str(), data.length(), true);
           Serial.println("Data written");
         }
       }
@@ -563,26 +2089,48 @@ void processATCommand(String cmd) {
     Serial.println("OK");
   }
   else {
+    commandKnown = false;
     Serial.println("ERROR: Unknown Command");
   }
 }
 
 void setup() {
+  // A TX ring lets loop() check for room instead of blocking on the UART
+  Serial.setTxBufferSize(UART_TX_BUFFER_SIZE);
   Serial.begin(921600);
   while (!Serial) { ; }  // Wait for serial port
+  if (!initOutputQueue()) {
+    Serial.println("ERROR: Output queue allocation failed.");
+  }
+  connectMutex = xSemaphoreCreateMutex();
+  perfUartTxCapacity = Serial.availableForWrite();
+  perfResetTime = esp_timer_get_time();
   Serial.println("AT Command Firmware Starting");
+  runProfile();
 }
 
+// Software flow control bytes accepted on the command input
+#define XON  0x11
+#define XOFF 0x13
+
 void loop() {
   while (Serial.available()) {
     char inChar = (char)Serial.read();
-    if (inChar == '\n' || inChar == '\r') {
+    if (inChar == XOFF) {
+      outputPaused = true;
+    } else if (inChar == XON) {
+      outputPaused = false;
+    } else if (inChar == '\n' || inChar == '\r') {
       if (inputBuffer.length() > 0) {
+        // Commands can outlast the 32-bit cycle counter, so time them in microseconds
+        int64_t start = esp_timer_get_time();
         processATCommand(inputBuffer);
+        perfRecord(perfCommands[perfCommandKey(inputBuffer)], (uint32_t)(esp_timer_get_time() - start));
         inputBuffer = "";
       }
     } else {
       inputBuffer += inChar;
     }
   }
+  drainOutput();
 }
@@ -1,26 +1,49 @@
 #include <Arduino.h>
 
 
-#include "BLEDevice.h"
+#include "BleStack.h"
 //#include "BLEScan.h"
 
 // The remote service we wish to connect to.
-static BLEUUID serviceUUID("4fafc201-1fb5-459e-8fcc-c5c9c331914b");
+static BleUUID serviceUUID("4fafc201-1fb5-459e-8fcc-c5c9c331914b");
 // The characteristic of the remote service we are interested in.
-static BLEUUID charUUID("beb5483e-36e1-4688-b7f5-ea07361b26a8");
+static BleUUID charUUID("beb5483e-36e1-4688-b7f5-ea07361b26a8");
 
 static boolean doConnect = false;
 static boolean connected = false;
 static boolean doScan = false;
-static BLERemoteCharacteristic *pRemoteCharacteristic;
-static BLEAdvertisedDevice *myDevice;
+static BleClient *pClient = nullptr;
+static BleRemoteCharacteristic *pRemoteCharacteristic;
+static BleAdvertisedDevice *myDevice;
 static int lastSequenceNumber = -1; // 上一个接收到的序列号
 static int missedPackets = 0; // 丢包计数器
 static int totalPackets = 0; //总数计数器
+static uint32_t totalBytes = 0; // Payload bytes received
 uint32_t startTime = 0;     // 开始时间
-int datasize = 80;
 
-static void notifyCallback(BLERemoteCharacteristic *pBLERemoteCharacteristic, uint8_t *pData, size_t length, bool isNotify) {
+// One-way latency relative to the fastest packet of the current measurement.
+// The peripheral stamps its micros() into bytes 6-9; the boards' clocks are not
+// synchronised, so only the spread above the minimum delay is meaningful.
+static bool haveLatencyBase = false;
+static uint32_t latencyBase = 0;    // First arrival-minus-send delta
+static int32_t latencyMin = 0;      // Smallest delta relative to the base
+static int64_t latencySum = 0;      // Sum of deltas relative to the base
+static uint32_t latencyCount = 0;
+
+// Throughput sweep, started by sending "SWEEP" over serial.
+// Each point is every combination of these, skipping payloads the MTU cannot carry.
+static const uint16_t sweepMtus[] = {23, 185, 247, 517};
+static const uint16_t sweepPayloads[] = {20, 80, 180, 244};
+static const uint16_t sweepIntervals[] = {6, 12, 24, 48};  // 1.25 ms units
+static const uint8_t sweepPhys[] = {BLE_PHY_1M, BLE_PHY_2M};
+const uint32_t SWEEP_SETTLE_MS = 1000;   // Let parameter updates and queues settle
+const uint32_t SWEEP_MEASURE_MS = 5000;
+const int SWEEP_RATE_MS = 1;             // Peripheral timer period during the sweep
+const int SWEEP_BURST = 4;               // Notifications per peripheral timer tick
+const uint16_t CONN_SUPERVISION_TIMEOUT = 400;  // 10 ms units
+String serialInput = "";
+
+static void notifyCallback(BleRemoteCharacteristic *pBLERemoteCharacteristic, uint8_t *pData, size_t length, bool isNotify) {
   /*
   Serial.print("Notify callback for characteristic ");
   Serial.print(pBLERemoteCharacteristic->getUUID().toString().c_str());
@@ -34,9 +57,22 @@ static void notifyCallback(BLERemoteCharacteristic *pBLERemoteCharacteristic, ui
   Serial.println();
   */
 
-   if (length == 80) { // 通过长度确认数据包是否完整
+   if (length >= 12 && pData[0] == 0xFF && pData[1] == 0xFF) { // 通过包头确认数据包是否完整
         int currentSequenceNumber = (pData[2] << 24) | (pData[3] << 16) | (pData[4] << 8) | pData[5]; // 计算当前序列号
         totalPackets++;
+        totalBytes += length;
+
+        uint32_t sendTime = (pData[6] << 24) | (pData[7] << 16) | (pData[8] << 8) | pData[9];
+        uint32_t delta = micros() - sendTime;
+        if (!haveLatencyBase) {
+            latencyBase = delta;
+            latencyMin = 0;
+            haveLatencyBase = true;
+        }
+        int32_t relative = (int32_t)(delta - latencyBase);
+        if (relative < latencyMin) latencyMin = relative;
+        latencySum += relative;
+        latencyCount++;
       //  Serial.print("Received sequence number: ");
       //  Serial.println(currentSequenceNumber);
 
@@ -51,33 +87,38 @@ static void notifyCallback(BLERemoteCharacteristic *pBLERemoteCharacteristic, ui
     }
 }
 
-class MyClientCallback : public BLEClientCallbacks {
-  void onConnect(BLEClient *pclient) {
+class MyClientCallback : public BleClientCallbacks {
+  void onConnect(BleClient *pclient) {
     connected = true;
   }
 
-  void onDisconnect(BLEClient *pclient) {
+  void onDisconnect(BleClient *pclient) {
     connected = false;
     Serial.println("onDisconnect");
   }
 };
 
-bool connectToServer() {
+bool connectToServer(uint16_t mtu) {
   Serial.print("Forming a connection to ");
   Serial.println(myDevice->getAddress().toString().c_str());
 
-  BLEClient *pClient = BLEDevice::createClient();
-  Serial.println(" - Created client");
-
-  pClient->setClientCallbacks(new MyClientCallback());
+  if (pClient == nullptr) {
+    pClient = BleDevice::createClient();
+    Serial.println(" - Created client");
+    pClient->setClientCallbacks(new MyClientCallback());
+  }
 
   // Connect to the remove BLE Server.
-  pClient->connect(myDevice);  // if you pass BLEAdvertisedDevice instead of address, it will be recognized type of peer device address (public or private)
+  // If you pass BleAdvertisedDevice instead of address, it will be recognized type of peer device address (public or private).
+  // Request the given MTU from the server (default is 23 otherwise).
+  if (!bleConnect(pClient, myDevice, mtu)) {
+    Serial.println(" - Connection failed");
+    return false;
+  }
   Serial.println(" - Connected to server");
-  pClient->setMTU(517);  //set client to request maximum MTU from server (default is 23 otherwise)
 
   // Obtain a reference to the service we are after in the remote BLE server.
-  BLERemoteService *pRemoteService = pClient->getService(serviceUUID);
+  BleRemoteService *pRemoteService = pClient->getService(serviceUUID);
   if (pRemoteService == nullptr) {
     Serial.print("Failed to find our service UUID: ");
     Serial.println(serviceUUID.toString().c_str());
@@ -98,6 +139,8 @@ bool connectToServer() {
   startTime = 0;
   missedPackets = 0;
   totalPackets = 0;
+  totalBytes = 0;
+  lastSequenceNumber = -1;
   // Read the value of the characteristic.
   /*
   if (pRemoteCharacteristic->canRead()) {
@@ -107,7 +150,7 @@ bool connectToServer() {
   }
   */
   if (pRemoteCharacteristic->canNotify()) {
-    pRemoteCharacteristic->registerForNotify(notifyCallback);
+    bleSubscribe(pRemoteCharacteristic, notifyCallback);
   }
 
   connected = true;
@@ -116,19 +159,19 @@ bool connectToServer() {
 /**
  * Scan for BLE servers and find the first one that advertises the service we are looking for.
  */
-class MyAdvertisedDeviceCallbacks : public BLEAdvertisedDeviceCallbacks {
+class MyAdvertisedDeviceCallbacks : public BleScanEvents {
   /**
    * Called for each advertising BLE server.
    */
-  void onResult(BLEAdvertisedDevice advertisedDevice) {
+  void onDevice(BleAdvertisedDevice& advertisedDevice) override {
     Serial.print("BLE Advertised Device found: ");
     Serial.println(advertisedDevice.toString().c_str());
 
     // We have found a device, let us now see if it contains the service we are looking for.
     if (advertisedDevice.haveServiceUUID() && advertisedDevice.isAdvertisingService(serviceUUID)) {
 
-      BLEDevice::getScan()->stop();
-      myDevice = new BLEAdvertisedDevice(advertisedDevice);
+      BleDevice::getScan()->stop();
+      myDevice = new BleAdvertisedDevice(advertisedDevice);
       doConnect = true;
       doScan = true;
 
@@ -136,15 +179,101 @@ class MyAdvertisedDeviceCallbacks : public BLEAdvertisedDeviceCallbacks {
   }  // onResult
 };  // MyAdvertisedDeviceCallbacks
 
+// Clear the counters at the start of a measurement window.
+void resetCounters() {
+  totalPackets = 0;
+  totalBytes = 0;
+  missedPackets = 0;
+  haveLatencyBase = false;
+  latencySum = 0;
+  latencyCount = 0;
+  startTime = millis();
+}
+
+// Configure the peripheral's stream on this connection through its write characteristic.
+void writePeripheralSetting(const char* setting) {
+  bleWriteValue(pRemoteCharacteristic, (const uint8_t*)setting, strlen(setting), true);
+}
+
+// Notifications the peripheral's stack has refused on this connection so far.
+uint32_t readPeripheralRefused() {
+  writePeripheralSetting("STATS");
+  std::string value = bleReadValue(pRemoteCharacteristic);
+  if (value.rfind("REFUSED=", 0) != 0) return 0;
+  return strtoul(value.c_str() + 8, nullptr, 10);
+}
+
+// Walk the MTU x PHY x interval x payload matrix and print one CSV row per point.
+// MTU is exchanged once per connection, so each MTU value gets a fresh connection.
+// "lost" counts sequence gaps (over-the-air loss); "refused" counts sends the
+// peripheral's stack turned away under load, which never got a sequence number.
+void runSweep() {
+  Serial.println("mtu,phy,interval_ms,payload,packets,lost,loss_pct,refused,goodput_kbps,latency_us");
+  char setting[16];
+  for (uint16_t mtu : sweepMtus) {
+    if (connected) {
+      pClient->disconnect();
+      delay(500);
+    }
+    if (!connectToServer(mtu)) {
+      Serial.printf("# mtu %u: connect failed, skipped\r\n", mtu);
+      continue;
+    }
+    uint16_t negotiatedMtu = pClient->getMTU();
+    snprintf(setting, sizeof(setting), "RATE=%d", SWEEP_RATE_MS);
+    writePeripheralSetting(setting);
+    snprintf(setting, sizeof(setting), "BURST=%d", SWEEP_BURST);
+    writePeripheralSetting(setting);
+    for (uint8_t phy : sweepPhys) {
+      // 1M is the default PHY, so it can still be measured if the request fails
+      if (!bleSetPhy(pClient, phy) && phy != BLE_PHY_1M) {
+        Serial.printf("# phy %u: not supported, skipped\r\n", phy);
+        continue;
+      }
+      for (uint16_t interval : sweepIntervals) {
+        bleUpdateConnParams(pClient, interval, interval, 0, CONN_SUPERVISION_TIMEOUT);
+        for (uint16_t payload : sweepPayloads) {
+          if (payload > negotiatedMtu - 3) continue;
+          snprintf(setting, sizeof(setting), "SIZE=%u", payload);
+          writePeripheralSetting(setting);
+          delay(SWEEP_SETTLE_MS);
+          if (!connected) {
+            Serial.println("# link lost, sweep aborted");
+            return;
+          }
+          uint32_t refusedStart = readPeripheralRefused();
+          resetCounters();
+          delay(SWEEP_MEASURE_MS);
+          float elapsed = (millis() - startTime) / 1000.0;
+          int packets = totalPackets;
+          int lost = missedPackets;
+          uint32_t refused = readPeripheralRefused() - refusedStart;
+          float lossPct = packets + lost > 0 ? 100.0 * lost / (packets + lost) : 0;
+          float kbps = totalBytes * 8.0 / (elapsed * 1000.0);
+          float latency = latencyCount > 0 ? (float)latencySum / latencyCount - latencyMin : 0;
+          Serial.printf("%u,%s,%.2f,%u,%d,%d,%.2f,%u,%.1f,%.0f\r\n", negotiatedMtu, phy == BLE_PHY_2M ? "2M" : "1M",
+                        interval * 1.25, payload, packets, lost, lossPct, refused, kbps, latency);
+        }
+      }
+    }
+  }
+  // Back to the peripheral's default stream
+  writePeripheralSetting("RATE=10");
+  writePeripheralSetting("BURST=1");
+  writePeripheralSetting("SIZE=80");
+  Serial.println("# sweep complete");
+  resetCounters();
+}
+
 void setup() {
   Serial.begin(115200);
   Serial.println("Starting Arduino BLE Client application...");
-  BLEDevice::init("");
+  bleInit("");
 
   // Retrieve a Scanner and set the callback we want to use to be informed when we
   // have detected a new device.  Specify that we want active scanning and start the
   // scan to run for 5 seconds.
-  BLEScan *pBLEScan = BLEDevice::getScan();
+  BleScan *pBLEScan = BleDevice::getScan();
   pBLEScan->setAdvertisedDeviceCallbacks(new MyAdvertisedDeviceCallbacks());
   pBLEScan->setInterval(1349);
   pBLEScan->setWindow(449);
@@ -158,8 +287,21 @@ void loop() {
   // If the flag "doConnect" is true then we have scanned for and found the desired
   // BLE Server with which we wish to connect.  Now we connect to it.  Once we are
   // connected we set the connected flag to be true.
+  while (Serial.available()) {
+    char inChar = (char)Serial.read();
+    if (inChar == '\n' || inChar == '\r') {
+      serialInput.trim();
+      if (serialInput == "SWEEP" && connected) {
+        runSweep();
+      }
+      serialInput = "";
+    } else {
+      serialInput += inChar;
+    }
+  }
+
   if (doConnect == true) {
-    if (connectToServer()) {
+    if (connectToServer(517)) {
       Serial.println("We are now connected to the BLE Server.");
     } else {
       Serial.println("We have failed to connect to the server; there is nothing more we will do.");
@@ -175,18 +317,19 @@ void loop() {
     { 
       unsigned long currentTime = millis();
       float elapsedTime = (currentTime - startTime) / 1000.0;
-      float kbps = (totalPackets * datasize * 8.0) / (elapsedTime * 1000.0);
+      float kbps = (totalBytes * 8.0) / (elapsedTime * 1000.0);
       Serial.print("每分钟丢包数: ");
       Serial.println(missedPackets);
       Serial.print("传输速率: ");
       Serial.print(kbps);
       Serial.println(" kbps");
       totalPackets = 0;
+      totalBytes = 0;
       missedPackets = 0;  // 重置计数器
       startTime = millis();  // 重置计时器         
     }
   } else if (doScan) {
-    BLEDevice::getScan()->start(0);  // this is just example to start scan after disconnect, most likely there is better way to do it in arduino
+    BleDevice::getScan()->start(0);  // this is just example to start scan after disconnect, most likely there is better way to do it in arduino
   }
 
 }  // End of loop
@@ -1,8 +1,5 @@
 #include <Arduino.h>
-#include <BLEDevice.h>
-#include <BLEUtils.h>
-#include <BLEServer.h>
-#include <BLE2902.h>
+#include "BleStack.h"
 #include <freertos/FreeRTOS.h>
 #include <freertos/task.h>
 #include <freertos/timers.h>
@@ -13,30 +10,118 @@
 #define SERVICE_UUID        "4fafc201-1fb5-459e-8fcc-c5c9c331914b"
 #define CHARACTERISTIC_UUID "beb5483e-36e1-4688-b7f5-ea07361b26a8"
 
-BLECharacteristic *pCharacteristic;
-uint32_t sequenceNumber = 0; // Sequence number
-const int DATA_SIZE = 80;    // Define data block size
-uint8_t data[DATA_SIZE];
-bool deviceConnected = false; // Flag to track client connection
+BleServer *pServer;
+BleCharacteristic *pCharacteristic;
+const int DATA_SIZE = 80;       // Default data block size
+const int MAX_DATA_SIZE = 512;  // Largest attribute value
+const int MIN_DATA_SIZE = 12;   // Header, sequence number, timestamp and footer
+const int MAX_BURST = 16;
+const int SEND_INTERVAL_MS = 10;
+const int MAX_CONNECTIONS = BLE_MAX_CONNECTIONS;  // Link limit of the BLE stack
+uint8_t data[MAX_DATA_SIZE];
+
+// State for one connected central
+struct PeerConnection {
+  bool active;
+  bool subscribed;           // Notifications enabled by this central
+  uint16_t connId;
+  uint32_t sequenceNumber;   // Sequence number, independent per connection
+  uint32_t intervalMs;       // Notification period, set with "RATE=<ms>"
+  int dataSize;              // Notification length, set with "SIZE=<bytes>"
+  int burst;                 // Notifications per timer tick, set with "BURST=<n>"
+  uint32_t sent;             // Notifications queued since the last report
+  uint32_t failed;           // Notifications the stack refused since the last report
+  uint32_t refused;          // Notifications the stack refused since connecting, read back with "STATS"
+  TimerHandle_t timer;
+};
+
+PeerConnection peers[MAX_CONNECTIONS];
+int connectedCount = 0;
+
+// Cost of one per-connection notification, in CPU cycles, since the last report
+uint64_t sendCycles = 0;
+uint32_t sendCount = 0;
+
+PeerConnection* findPeer(uint16_t connId) {
+  for (int i = 0; i < MAX_CONNECTIONS; i++) {
+    if (peers[i].active && peers[i].connId == connId) return &peers[i];
+  }
+  return nullptr;
+}
 
 // Custom server callbacks to manage connection status
-class MyServerCallbacks: public BLEServerCallbacks {
-  void onConnect(BLEServer* pServer) override {
-    deviceConnected = true;
-    Serial.println("Client connected");
+class MyServerCallbacks: public BleServerEvents {
+  void onPeerConnect(BleServer* pServer, uint16_t connId) override {
+    PeerConnection* peer = nullptr;
+    for (int i = 0; i < MAX_CONNECTIONS; i++) {
+      if (!peers[i].active) {
+        peer = &peers[i];
+        break;
+      }
+    }
+    if (peer == nullptr) {
+      Serial.println("Client rejected, connection limit reached");
+      pServer->disconnect(connId);
+      return;
+    }
+    peer->connId = connId;
+    peer->sequenceNumber = 0;
+    peer->intervalMs = SEND_INTERVAL_MS;
+    peer->dataSize = DATA_SIZE;
+    peer->burst = 1;
+    peer->sent = 0;
+    peer->failed = 0;
+    peer->refused = 0;
+    peer->subscribed = false;
+    peer->active = true;
+    connectedCount++;
+    Serial.printf("Client %u connected (%d/%d)\r\n", peer->connId, connectedCount, MAX_CONNECTIONS);
+    // Advertising stops on connect; keep accepting centrals while there is room
+    if (connectedCount < MAX_CONNECTIONS) {
+      BleDevice::startAdvertising();
+    }
   }
 
-  void onDisconnect(BLEServer* pServer) override {
-    deviceConnected = false;
-    Serial.println("Client disconnected");
+  void onPeerDisconnect(BleServer* pServer, uint16_t connId) override {
+    PeerConnection* peer = findPeer(connId);
+    if (peer != nullptr) {
+      xTimerStop(peer->timer, 0);
+      peer->subscribed = false;
+      peer->active = false;
+      connectedCount--;
+    }
+    Serial.printf("Client %u disconnected (%d/%d)\r\n", connId, connectedCount, MAX_CONNECTIONS);
     // Restart advertising so new clients can connect
-    BLEDevice::startAdvertising();
+    BleDevice::startAdvertising();
   }
 };
 
+// Applies a "RATE=<ms>", "SIZE=<bytes>" or "BURST=<n>" setting to the writing connection.
+// "STATS" leaves "REFUSED=<n>" in the characteristic for that central to read.
+void applyPeerSetting(PeerConnection* peer, const std::string& value) {
+  if (value.rfind("RATE=", 0) == 0) {
+    int intervalMs = atoi(value.c_str() + 5);
+    if (intervalMs > 0) {
+      peer->intervalMs = intervalMs;
+      // Changing the period also starts the timer, so leave it to onPeerSubscribe
+      if (peer->subscribed) xTimerChangePeriod(peer->timer, pdMS_TO_TICKS(intervalMs), 0);
+    }
+  } else if (value.rfind("SIZE=", 0) == 0) {
+    int size = atoi(value.c_str() + 5);
+    peer->dataSize = constrain(size, MIN_DATA_SIZE, MAX_DATA_SIZE);
+  } else if (value.rfind("BURST=", 0) == 0) {
+    int burst = atoi(value.c_str() + 6);
+    peer->burst = constrain(burst, 1, MAX_BURST);
+  } else if (value == "STATS") {
+    char reply[24];
+    snprintf(reply, sizeof(reply), "REFUSED=%u", peer->refused);
+    pCharacteristic->setValue((uint8_t*)reply, strlen(reply));
+  }
+}
+
 // Custom characteristic callbacks to handle write events
-class MyCharacteristicCallbacks: public BLECharacteristicCallbacks {
-  void onWrite(BLECharacteristic *pCharacteristic) override {
+class MyCharacteristicCallbacks: public BleWriteEvents {
+  void onPeerWrite(BleCharacteristic *pCharacteristic, uint16_t connId) override {
     std::string rxValue = pCharacteristic->getValue();
     if (rxValue.length() > 0) {
       Serial.print("Received Value: ");
@@ -44,36 +129,73 @@ class MyCharacteristicCallbacks: public BLECharacteristicCallbacks {
         Serial.print(rxValue[i]);
       }
       Serial.println();
+      PeerConnection* peer = findPeer(connId);
+      if (peer != nullptr) {
+        applyPeerSetting(peer, rxValue);
+      }
     }
   }
+
+  // Stream to a central only while it has notifications enabled
+  void onPeerSubscribe(BleCharacteristic *pCharacteristic, uint16_t connId, bool subscribed) override {
+    PeerConnection* peer = findPeer(connId);
+    if (peer == nullptr || peer->subscribed == subscribed) return;
+    peer->subscribed = subscribed;
+    if (subscribed) {
+      xTimerChangePeriod(peer->timer, pdMS_TO_TICKS(peer->intervalMs), 0);
+    } else {
+      xTimerStop(peer->timer, 0);
+    }
+    Serial.printf("Client %u %s\r\n", connId, subscribed ? "subscribed" : "unsubscribed");
+  }
 };
 
-void sendData() {
+void sendData(PeerConnection* peer) {
+  uint32_t start = ESP.getCycleCount();
+  // Never exceed what fits in one notification on this link
+  int size = min(peer->dataSize, (int)pServer->getPeerMTU(peer->connId) - 3);
+  if (size < MIN_DATA_SIZE) size = MIN_DATA_SIZE;
+
   // Add the sequence number (stored in bytes 2-5)
-  data[2] = (sequenceNumber >> 24) & 0xFF; // Most significant byte
-  data[3] = (sequenceNumber >> 16) & 0xFF;
-  data[4] = (sequenceNumber >> 8) & 0xFF;
-  data[5] = sequenceNumber & 0xFF; // Least significant byte
+  data[2] = (peer->sequenceNumber >> 24) & 0xFF; // Most significant byte
+  data[3] = (peer->sequenceNumber >> 16) & 0xFF;
+  data[4] = (peer->sequenceNumber >> 8) & 0xFF;
+  data[5] = peer->sequenceNumber & 0xFF; // Least significant byte
+
+  // Send time in microseconds (bytes 6-9) so the central can measure latency
+  uint32_t now = micros();
+  data[6] = (now >> 24) & 0xFF;
+  data[7] = (now >> 16) & 0xFF;
+  data[8] = (now >> 8) & 0xFF;
+  data[9] = now & 0xFF;
 
   // Fill the middle part with incremental data as an example
-  for (int i = 6; i < DATA_SIZE - 2; i++) {
-    data[i] = (uint8_t)(i - 6);
+  for (int i = 10; i < size - 2; i++) {
+    data[i] = (uint8_t)(i - 10);
   }
 
-  data[DATA_SIZE - 2] = 0xFE; // Footer byte 1
-  data[DATA_SIZE - 1] = 0xFE; // Footer byte 2
+  data[size - 2] = 0xFE; // Footer byte 1
+  data[size - 1] = 0xFE; // Footer byte 2
 
-  // Only send notification if a client is connected
-  if (deviceConnected) {
-    pCharacteristic->setValue(data, sizeof(data));
-    pCharacteristic->notify(); // Notify the client that data has been updated
-    sequenceNumber++; // Increase the sequence number
+  // Notify only this connection so each central sees its own sequence.
+  // Only accepted sends use up a number, so gaps at the central are over-the-air loss.
+  if (bleNotifyConnection(pCharacteristic, peer->connId, data, size)) {
+    peer->sent++;
+    peer->sequenceNumber++; // Increase the sequence number
+  } else {
+    peer->failed++;
+    peer->refused++;
   }
+  sendCycles += ESP.getCycleCount() - start;
+  sendCount++;
 }
 
-// Timer callback to periodically send data
+// Timer callback to periodically send data to one connection
 void onTimer(TimerHandle_t xTimer) {
-  sendData();
+  PeerConnection* peer = &peers[(intptr_t)pvTimerGetTimerID(xTimer)];
+  for (int i = 0; i < peer->burst && peer->active && peer->subscribed; i++) {
+    sendData(peer);
+  }
 }
 
 void setup() {
@@ -84,37 +206,55 @@ void setup() {
   data[0] = 0xFF; // Header byte 1
   data[1] = 0xFF; // Header byte 2
 
-  BLEDevice::init("NewNode");
-  BLEServer *pServer = BLEDevice::createServer();
+  for (int i = 0; i < MAX_CONNECTIONS; i++) {
+    peers[i].active = false;
+    peers[i].subscribed = false;
+    peers[i].timer = xTimerCreate("DataTimer", pdMS_TO_TICKS(SEND_INTERVAL_MS), pdTRUE, (void *)(intptr_t)i, onTimer);
+  }
+
+  bleInit("NewNode");
+  pServer = BleDevice::createServer();
   pServer->setCallbacks(new MyServerCallbacks());
-  BLEService *pService = pServer->createService(SERVICE_UUID);
+  BleService *pService = pServer->createService(SERVICE_UUID);
 
   pCharacteristic = pService->createCharacteristic(
       CHARACTERISTIC_UUID,
-      BLECharacteristic::PROPERTY_READ |
-      BLECharacteristic::PROPERTY_WRITE |
-      BLECharacteristic::PROPERTY_NOTIFY
+      BLE_PROPERTY_READ |
+      BLE_PROPERTY_WRITE |
+      BLE_PROPERTY_NOTIFY
   );
 
-  // Set the custom callback for write events
-  pCharacteristic->setCallbacks(new MyCharacteristicCallbacks());
-
   // Add the Client Characteristic Configuration Descriptor to allow notifications
-  pCharacteristic->addDescriptor(new BLE2902());
+  bleAddNotifyDescriptor(pCharacteristic);
+
+  // Set the custom callback for write and subscription events
+  bleSetWriteEvents(pCharacteristic, new MyCharacteristicCallbacks());
 
   pService->start();
-  BLEAdvertising *pAdvertising = BLEDevice::getAdvertising();
+  BleAdvertising *pAdvertising = BleDevice::getAdvertising();
   pAdvertising->addServiceUUID(SERVICE_UUID);
   pAdvertising->setScanResponse(true);
   pAdvertising->setMinPreferred(0x06);
   pAdvertising->setMinPreferred(0x12);
-  BLEDevice::startAdvertising();
+  BleDevice::startAdvertising();
   Serial.println("BLE Server started, waiting for clients...");
-
-  TimerHandle_t timer = xTimerCreate("DataTimer", pdMS_TO_TICKS(10), pdTRUE, (void *)0, onTimer);
-  xTimerStart(timer, 0);
 }
 
 void loop() {
-  // put your main code here, to run repeatedly:
+  // Report fan-out cost every 10 seconds
+  delay(10000);
+  if (connectedCount == 0) return;
+  float mhz = getCpuFrequencyMhz();
+  Serial.printf("Connections: %d, mean send cost: %.2f us\r\n", connectedCount,
+                sendCount ? sendCycles / (float)sendCount / mhz : 0);
+  for (int i = 0; i < MAX_CONNECTIONS; i++) {
+    PeerConnection& peer = peers[i];
+    if (!peer.active) continue;
+    Serial.printf("  Client %u: interval %u ms, size %d, burst %d, sent %u, failed %u, seq %u\r\n",
+                  peer.connId, peer.intervalMs, peer.dataSize, peer.burst, peer.sent, peer.failed, peer.sequenceNumber);
+    peer.sent = 0;
+    peer.failed = 0;
+  }
+  sendCycles = 0;
+  sendCount = 0;
 }
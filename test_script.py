@@ -3,6 +3,7 @@ import serial
 import threading
 import argparse
 import re
+import struct
 import time
 
 addresses = [
@@ -12,8 +13,12 @@ addresses = [
     "d8:3b:da:6e:ee:9d",
 ]
 
-# Global dictionary to hold statistics for each client (client_id -> {'last_seq': int, 'dropped': int})
+# Global dictionary to hold statistics for each client stream ("client:stream" -> {'last_seq': int, 'dropped': int})
 client_stats = {}
+# Drops the bridge reported itself via +DROP (client id -> total)
+bridge_drops = {}
+# Merge mode: last arrival timestamp and order violations per port
+merge_stats = {}
 stats_lock = threading.Lock()
 
 
@@ -30,23 +35,45 @@ def read_and_print(ser):
             break
 
 
+drop_pattern = re.compile(r"^\+DROP:(?P<client>\d+),(?P<new>\d+),(?P<total>\d+)$")
+
 notification_pattern = re.compile(
-    r"^(?P<client>[0-9A-Fa-f]{2})\s+FF\s+FF\s+(?P<seq>(?:[0-9A-Fa-f]{2}\s+){3}[0-9A-Fa-f]{2}).*$"
+    r"^(?P<client>[0-9A-Fa-f]{2}):(?P<stream>[0-9A-Fa-f])(?:@(?P<ts>\d+))?\s+FF\s+FF\s+(?P<seq>(?:[0-9A-Fa-f]{2}\s+){3}[0-9A-Fa-f]{2}).*$"
 )
 
 
 def process_line(line, port_name):
     """Process a line of hex data from the serial port and update packet drop count."""
     line = line.strip()
+    if line == "OK":
+        return
+    drop = drop_pattern.match(line)
+    if drop:
+        with stats_lock:
+            bridge_drops[drop.group("client")] = int(drop.group("total"))
+        print(
+            f"[{port_name}] Client {drop.group('client')}: Bridge dropped {drop.group('new')} notifications."
+        )
+        return
     match = notification_pattern.match(line)
     if match:
         try:
-            # Convert the client id from hex to integer (e.g., "01" -> 1)
-            client_id = int(match.group("client"), 16)
+            # Convert the client and stream ids from hex (e.g., "01:0" -> "1:0")
+            client_id = f"{int(match.group('client'), 16)}:{int(match.group('stream'), 16)}"
         except Exception as e:
             print(f"[{port_name}] Error parsing client id: {e}")
             return
 
+        if match.group("ts") is not None:
+            # Merged output must arrive in bridge timestamp order across clients
+            ts = int(match.group("ts"))
+            with stats_lock:
+                stats = merge_stats.setdefault(port_name, {"last_ts": ts, "out_of_order": 0})
+                if ts < stats["last_ts"]:
+                    stats["out_of_order"] += 1
+                    print(f"[{port_name}] Client {client_id}: Out of order by {stats['last_ts'] - ts} us.")
+                stats["last_ts"] = max(ts, stats["last_ts"])
+
         seq_str = match.group("seq")
         seq_bytes = seq_str.split()
         if len(seq_bytes) == 4:
@@ -83,7 +110,19 @@ def process_line(line, port_name):
         print(f"[{port_name}] Unrecognized format: {line}")
 
 
-def serial_thread(port_name, baudrate, address_subset):
+def wait_for_ready(ser, timeout=30):
+    """Wait for the bridge to restore its saved profile after reset."""
+    deadline = time.time() + timeout
+    while time.time() < deadline:
+        line = ser.readline().decode("utf-8").strip()
+        if line:
+            print(ser.port + " < " + line)
+        if line.startswith("+READY:"):
+            return True
+    return False
+
+
+def serial_thread(port_name, baudrate, address_subset, use_profile, save_profile, credits, policy, merge_hold):
     try:
         ser = serial.Serial(port=port_name, baudrate=baudrate, timeout=2)
         print(f"Opened serial port: {port_name}")
@@ -93,6 +132,13 @@ def serial_thread(port_name, baudrate, address_subset):
         print(f"Failed to open port {port_name}: {e}")
         return
 
+    if use_profile:
+        # Opening the port resets the board, which then replays its saved profile
+        if not wait_for_ready(ser):
+            print(f"[{port_name}] No +READY from saved profile")
+            return
+        address_subset = []
+
     # Configure BLE connections for each address in the subset
     for idx, address in enumerate(address_subset):
         write_and_print(ser, "AT+BLESTART\r\n")
@@ -112,11 +158,25 @@ def serial_thread(port_name, baudrate, address_subset):
         time.sleep(2)
         read_and_print(ser)
         time.sleep(1)
-    time.sleep(1)
-    write_and_print(ser, "AT+BLENOTIFY=1\r\n")
-    time.sleep(1)
-    write_and_print(ser, "AT+BLENOTIFY=2\r\n")
-    time.sleep(1)
+    if address_subset:
+        time.sleep(1)
+        write_and_print(ser, "AT+BLENOTIFY=1\r\n")
+        time.sleep(1)
+        write_and_print(ser, "AT+BLENOTIFY=2\r\n")
+        time.sleep(1)
+        if save_profile:
+            write_and_print(ser, "AT+PROFILE=SAVE\r\n")
+            read_and_print(ser)
+
+    if merge_hold is not None:
+        write_and_print(ser, f"AT+MERGE=1,{merge_hold}\r\n")
+        read_and_print(ser)
+    if credits:
+        # Grant output in half-window top-ups as lines are consumed
+        write_and_print(ser, f"AT+FLOW=1,{policy}\r\n")
+        read_and_print(ser)
+        write_and_print(ser, f"AT+CREDIT={credits}\r\n")
+    consumed = 0
 
     # Continuously read notifications and process them
     while True:
@@ -124,6 +184,11 @@ def serial_thread(port_name, baudrate, address_subset):
             line = ser.readline().decode("utf-8").strip()
             if line:
                 process_line(line, port_name)
+                if notification_pattern.match(line):
+                    consumed += 1
+                if credits and consumed >= credits // 2:
+                    ser.write(f"AT+CREDIT={consumed}\r\n".encode("utf-8"))
+                    consumed = 0
             else:
                 time.sleep(0.1)
         except Exception as e:
@@ -131,6 +196,52 @@ def serial_thread(port_name, baudrate, address_subset):
             break
 
 
+# One capture record: arrival us, payload length, client id, stream id
+capture_header = struct.Struct("<qHBB")
+
+
+def dump_capture(port_name, baudrate, path):
+    """Fetch the bridge capture ring with AT+CAPDUMP and save it as CSV."""
+    ser = serial.Serial()
+    ser.port = port_name
+    ser.baudrate = baudrate
+    ser.timeout = 5
+    # Keep DTR/RTS released so opening the port does not reset the board
+    ser.dtr = False
+    ser.rts = False
+    ser.open()
+    ser.reset_input_buffer()
+    write_and_print(ser, "AT+CAPDUMP\r\n")
+    line = ""
+    while not line.startswith("+CAPDUMP:"):
+        line = ser.readline().decode("utf-8").strip()
+        print(ser.port + " < " + line)
+        if line.startswith("ERROR") or line == "":
+            return
+    records, total, trigger_us = (int(v) for v in line[len("+CAPDUMP:") :].split(","))
+    data = bytearray()
+    while len(data) < total:
+        chunk = ser.readline().decode("utf-8").strip()
+        if not chunk.startswith("+CAPDATA:"):
+            print(f"[{port_name}] Unexpected line in capture dump: {chunk}")
+            return
+        length = int(chunk[len("+CAPDATA:") :])
+        data += ser.read(length)
+    read_and_print(ser)
+
+    with open(path, "w") as out:
+        out.write("arrival_us,since_trigger_us,client,stream,data\n")
+        offset = 0
+        for _ in range(records):
+            ts, length, client, stream = capture_header.unpack_from(data, offset)
+            offset += capture_header.size
+            payload = data[offset : offset + length].hex(" ").upper()
+            offset += length
+            since = ts - trigger_us if trigger_us else ""
+            out.write(f"{ts},{since},{client},{stream},{payload}\n")
+    print(f"[{port_name}] Saved {records} captured notifications to {path}")
+
+
 def main():
     parser = argparse.ArgumentParser(description="BLE AT Firmware Packet Drop Counter")
     parser.add_argument(
@@ -145,8 +256,45 @@ def main():
         default=921600,
         help="Baud rate for serial communication (default: 921600)",
     )
+    parser.add_argument(
+        "--profile",
+        action="store_true",
+        help="Skip setup and wait for the bridge to restore its saved profile",
+    )
+    parser.add_argument(
+        "--save-profile",
+        action="store_true",
+        help="Save the connections as the bridge boot profile after setup",
+    )
+    parser.add_argument(
+        "--credits",
+        type=int,
+        default=0,
+        help="Enable credit flow control with this many lines in flight (default: off)",
+    )
+    parser.add_argument(
+        "--policy",
+        choices=["OLDEST", "NEWEST", "DECIMATE"],
+        default="NEWEST",
+        help="What the bridge drops when out of credit (default: NEWEST)",
+    )
+    parser.add_argument(
+        "--merge",
+        type=int,
+        metavar="HOLD_MS",
+        help="Have the bridge merge clients in arrival order, holding each line this long so late arrivals can go first",
+    )
+    parser.add_argument(
+        "--dump-capture",
+        metavar="FILE",
+        help="Save the capture of the first port as CSV with AT+CAPDUMP and exit",
+    )
     args = parser.parse_args()
 
+    if args.dump_capture:
+        dump_capture(args.ports[0], args.baudrate, args.dump_capture)
+        return
+
     threads = []
     port_num = len(args.ports)
 
@@ -157,6 +305,11 @@ def main():
                 port,
                 args.baudrate,
                 addresses[idx * port_num : (idx + 1) * port_num],
+                args.profile,
+                args.save_profile,
+                args.credits,
+                args.policy,
+                args.merge,
             ),
         )
         t.daemon = True
@@ -173,6 +326,10 @@ def main():
                     print(
                         f"Summary - Client {client_id}: Dropped Packets: {stats['dropped']}"
                     )
+                for client_id, total in bridge_drops.items():
+                    print(f"Summary - Client {client_id}: Dropped by Bridge: {total}")
+                for port_name, stats in merge_stats.items():
+                    print(f"Summary - Port {port_name}: Out of Order: {stats['out_of_order']}")
     except KeyboardInterrupt:
         print("Exiting monitoring.")
 